@@ -0,0 +1,131 @@
+#include <new>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+
+#include "bench.h"
+#include "../src/diagnostics.h"
+
+static std::atomic<size_t> allocCount = 0;
+static std::atomic<size_t> allocBytes = 0;
+static std::atomic<size_t> liveBytes = 0;
+static std::atomic<size_t> peakBytes = 0;
+
+void *operator new(size_t size) {
+  void *ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  allocCount.fetch_add(1, std::memory_order_relaxed);
+  allocBytes.fetch_add(size, std::memory_order_relaxed);
+  size_t live = liveBytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed) + malloc_usable_size(ptr);
+  size_t peak = peakBytes.load(std::memory_order_relaxed);
+  while (live > peak && !peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+  return ptr;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr == nullptr) return;
+  liveBytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+  free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
+Bench::Allocations Bench::Allocations::current() {
+  Allocations out;
+  out.count = allocCount.load(std::memory_order_relaxed);
+  out.bytes = allocBytes.load(std::memory_order_relaxed);
+  out.live = liveBytes.load(std::memory_order_relaxed);
+  out.peak = peakBytes.load(std::memory_order_relaxed);
+  return out;
+}
+
+void Bench::Allocations::resetPeak() {
+  peakBytes.store(liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void Bench::State::start() {
+  startAllocs = Allocations::current();
+  startTime = Util::Time::getTime();
+}
+
+void Bench::State::stop() {
+  elapsed += Util::Time::getTime() - startTime;
+  auto endAllocs = Allocations::current();
+  allocs += endAllocs.count - startAllocs.count;
+  allocBytes += endAllocs.bytes - startAllocs.bytes;
+}
+
+double Bench::Result::nsPerOp() const {
+  return iterations == 0 ? 0 : (double)elapsed / (double)iterations;
+}
+
+double Bench::Result::allocsPerOp() const {
+  return iterations == 0 ? 0 : (double)allocs / (double)iterations;
+}
+
+Bench::Suite::Suite(int64_t minTime) : minTime(minTime) {}
+
+void Bench::Suite::add(const std::string &name, BenchFn fn) {
+  entries.push_back({name, std::move(fn)});
+}
+
+std::vector<Bench::Result> Bench::Suite::run(const std::string &filter) {
+  std::vector<Result> results;
+  for (auto &entry : entries) {
+    if (!filter.empty() && entry.name.find(filter) == std::string::npos) continue;
+
+    size_t iterations = 1;
+    for (;;) {
+      State state(iterations);
+      entry.fn(state);
+      if (state.elapsed >= minTime || iterations >= 1000000000) {
+        Result result;
+        result.name = entry.name;
+        result.iterations = iterations;
+        result.elapsed = state.elapsed;
+        result.allocs = state.allocs;
+        result.allocBytes = state.allocBytes;
+        std::cout << printResult(result) << std::endl;
+        results.push_back(result);
+        break;
+      }
+
+      // Aim slightly past minTime based on the last run, growing at most 100x at a time
+      double perOp = state.elapsed <= 0 ? 0 : (double)state.elapsed / (double)iterations;
+      size_t next = perOp == 0 ? iterations * 100 : (size_t)((double)minTime * 1.2 / perOp);
+      iterations = std::max(iterations + 1, std::min(next, iterations * 100));
+    }
+  }
+  return results;
+}
+
+std::string Bench::printResult(const Result &result) {
+  char line[256];
+  snprintf(
+    line,
+    sizeof(line),
+    "%-48s %10zu %16.1f ns/op %12.1f allocs/op %14.1f B/op",
+    result.name.c_str(),
+    result.iterations,
+    result.nsPerOp(),
+    result.allocsPerOp(),
+    result.iterations == 0 ? 0.0 : (double)result.allocBytes / (double)result.iterations
+  );
+  return line;
+}
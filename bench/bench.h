@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace Bench {
+  // Process-wide heap allocation counters, maintained by the replaced global operator new
+  struct Allocations {
+    size_t count = 0;
+    size_t bytes = 0;
+    // Bytes currently allocated, and the highest value since the last resetPeak
+    size_t live = 0;
+    size_t peak = 0;
+
+    static Allocations current();
+    static void resetPeak();
+  };
+
+  // Passed to a benchmark body, which runs [iterations] times and brackets the measured work with start/stop
+  struct State {
+    explicit State(size_t iterations) : iterations(iterations) {}
+
+    const size_t iterations;
+
+    int64_t elapsed = 0;
+    size_t allocs = 0;
+    size_t allocBytes = 0;
+
+    void start();
+    void stop();
+
+  private:
+    int64_t startTime = 0;
+    Allocations startAllocs;
+  };
+
+  typedef std::function<void(State &state)> BenchFn;
+
+  struct Result {
+    std::string name;
+    size_t iterations = 0;
+    int64_t elapsed = 0;
+    size_t allocs = 0;
+    size_t allocBytes = 0;
+
+    [[nodiscard]] double nsPerOp() const;
+    [[nodiscard]] double allocsPerOp() const;
+  };
+
+  struct Suite {
+    struct Entry {
+      std::string name;
+      BenchFn fn;
+    };
+
+    std::vector<Entry> entries;
+
+    // Minimum measured time before a result is accepted
+    int64_t minTime;
+
+    explicit Suite(int64_t minTime);
+
+    void add(const std::string &name, BenchFn fn);
+
+    // Runs every benchmark whose name contains [filter], increasing the iteration count until minTime is reached
+    std::vector<Result> run(const std::string &filter = "");
+  };
+
+  std::string printResult(const Result &result);
+}
@@ -0,0 +1,98 @@
+#include <random>
+
+#include "generator.h"
+
+struct Generator {
+  const Gen::Params &params;
+  std::mt19937_64 random;
+  std::string out;
+
+  explicit Generator(const Gen::Params &params) : params(params), random(params.seed) {}
+
+  size_t pick(size_t bound) {
+    return std::uniform_int_distribution<size_t>(0, bound - 1)(random);
+  }
+
+  void emitRun(char c, size_t count) {
+    out.append(count, c);
+  }
+
+  // A pure seek, which lowering turns into defs and scan loops
+  void emitSeek() {
+    emitRun(pick(2) ? '>' : '<', 1 + pick(3));
+    for (size_t i = 0; i < params.seekComplexity; i++) {
+      out += '[';
+      emitRun(pick(2) ? '>' : '<', 1 + pick(2));
+      out += ']';
+      if (pick(2)) emitRun('>', 1 + pick(2));
+    }
+  }
+
+  // Straight-line arithmetic, movement and output of roughly [length] instructions
+  void emitStraight(size_t length) {
+    size_t end = out.size() + length;
+    while (out.size() < end) {
+      switch (pick(8)) {
+        case 0:
+        case 1:
+          emitRun('+', 1 + pick(4));
+          break;
+        case 2:
+          emitRun('-', 1 + pick(4));
+          break;
+        case 3:
+          emitRun('>', 1 + pick(3));
+          break;
+        case 4:
+          emitRun('<', 1 + pick(3));
+          break;
+        case 5:
+          out += '.';
+          break;
+        case 6:
+          if (params.seekComplexity != 0) {
+            emitSeek();
+          } else {
+            out += '>';
+          }
+          break;
+        default:
+          out += pick(16) == 0 ? ',' : '+';
+          break;
+      }
+    }
+  }
+
+  // A balanced-looking nest of impure loops with a straight-line body at each level
+  void emitNest(size_t depth, size_t bodyLength) {
+    out += "-[";
+    emitStraight(bodyLength);
+    if (depth > 1) {
+      emitNest(depth - 1, bodyLength);
+    }
+    out += "-]";
+  }
+
+  std::string generate() {
+    size_t nestCost = params.loops == 0 ? 0 : params.length / 2;
+    size_t straightLength = params.length - nestCost;
+    size_t chunks = params.loops + 1;
+    size_t chunkLength = straightLength / chunks;
+    size_t bodyLength = params.loops == 0 ? 0 : std::max<size_t>(
+      1,
+      nestCost / (params.loops * std::max<size_t>(params.depth, 1))
+    );
+
+    out.reserve(params.length + params.length / 8);
+    emitStraight(chunkLength);
+    for (size_t i = 0; i < params.loops; i++) {
+      emitNest(std::max<size_t>(params.depth, 1), bodyLength);
+      emitStraight(chunkLength);
+    }
+    return std::move(out);
+  }
+};
+
+std::string Gen::generate(const Params &params) {
+  return Generator(params).generate();
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+// Deterministic generator for large synthetic brainfuck programs, these are compiled but never run
+namespace Gen {
+  struct Params {
+    // Approximate total number of instructions
+    size_t length = 1000;
+    // Number of top-level loop nests
+    size_t loops = 0;
+    // Depth of each loop nest
+    size_t depth = 1;
+    // Number of scan loops inside each seek, 0 emits plain pointer movement
+    size_t seekComplexity = 0;
+    uint64_t seed = 1;
+  };
+
+  std::string generate(const Params &params);
+}
@@ -0,0 +1,268 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <clipp.h>
+
+#include "sha1.h"
+#include "stats.h"
+#include "yaml.h"
+#include "../src/bf.h"
+#include "../src/lowering.h"
+#include "../src/eval.h"
+#include "../src/opt.h"
+#include "../src/jit.h"
+
+using namespace clipp;
+
+struct RunIO {
+  const std::string *input = nullptr;
+  size_t inputIndex = 0;
+  std::string output;
+  int eofValue = 0;
+};
+
+static int runGetchar(RunIO *io) {
+  if (io->inputIndex == io->input->size()) {
+    return io->eofValue;
+  }
+  return (unsigned char)(*io->input)[io->inputIndex++];
+}
+
+static void runPutchar(RunIO *io, int c) {
+  io->output.push_back((char)c);
+}
+
+static void runWrite(RunIO *io, const char *data, size_t size) {
+  io->output.append(data, size);
+}
+
+static std::string readFile(const std::string &path) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.is_open()) {
+    std::cerr << std::system_error(
+      errno, std::system_category(), "Error: Failed to open \"" + path + "\""
+    ).what() << std::endl;
+    std::exit(1);
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+struct Options {
+  std::string configFile = "config.yaml";
+  std::string baselineFile = "benchmark_native.yaml";
+  std::string filter;
+  std::string memory = "0,65536";
+  int warmup = 3;
+  int trials = 30;
+  int64_t minSampleTime = 10;
+  double alpha = 0.01;
+  double threshold = 0.02;
+  bool update = false;
+};
+
+struct Outcome {
+  bool failed = false;
+  bool regressed = false;
+};
+
+static std::string formatTime(double ns) {
+  return Util::Time::printTime((int64_t)ns);
+}
+
+static std::unique_ptr<BFVM::Handle> compileBenchmark(
+  const BFVM::Config &config,
+  JIT::Pipeline &jit,
+  const std::string &code
+) {
+  auto program = BF::Program::parse(code);
+  auto prefix = Eval::run(config, program);
+  auto graph = Lowering::buildProgram(config, program, &prefix);
+  graph->buildDominators();
+  Opt::Pipeline pipeline(config);
+  pipeline.run(*graph);
+  auto handle = jit.compile(*graph, "bench");
+  graph->destroy();
+  return handle;
+}
+
+static Outcome runBenchmark(const Options &options, const Yaml::Node &info, Yaml::Node &baselines) {
+  Outcome outcome;
+  auto nameNode = info.get("name");
+  auto srcNode = info.get("src");
+  if (nameNode == nullptr || srcNode == nullptr) {
+    std::cerr << "Error: Benchmark is missing a name or src" << std::endl;
+    std::exit(1);
+  }
+  const std::string &name = nameNode->scalar;
+  if (!options.filter.empty() && name.find(options.filter) == std::string::npos) return outcome;
+
+  BFVM::Config config;
+  if (auto width = info.get("width")) config.cellWidth = std::stoi(width->scalar);
+  auto delimiter = options.memory.find(',');
+  config.memory.sizeLeft = Memory::parseSize(options.memory.substr(0, delimiter));
+  config.memory.sizeRight = Memory::parseSize(
+    delimiter == std::string::npos ? options.memory : options.memory.substr(delimiter + 1)
+  );
+
+  std::string code = readFile(srcNode->scalar);
+  std::string input;
+  if (auto inputNode = info.get("input")) input = readFile(inputNode->scalar);
+
+  JIT::Pipeline jit(config);
+  jit.addSymbol("bf_putchar", runPutchar);
+  jit.addSymbol("bf_getchar", runGetchar);
+  jit.addSymbol("bf_write", runWrite);
+  auto handle = compileBenchmark(config, jit, code);
+
+  Memory::Tape tape(config.memory);
+  RunIO io;
+  io.input = &input;
+  io.eofValue = (int)config.eofValue;
+
+  auto runOnce = [&]() {
+    tape.clear();
+    io.inputIndex = 0;
+    io.output.clear();
+    (*handle)(&io, tape.start);
+  };
+
+  // Verify output before spending any time measuring
+  runOnce();
+  std::string hash = Bench::sha1(io.output);
+  auto outputNode = info.get("output");
+  if (outputNode != nullptr && !outputNode->isNull() && outputNode->scalar != hash) {
+    std::cerr << "[" << name << "] Output mismatch " << hash << " vs " << outputNode->scalar << std::endl;
+    outcome.failed = true;
+    return outcome;
+  }
+
+  for (int i = 1; i < options.warmup; i++) {
+    runOnce();
+  }
+
+  Yaml::Node &baseline = baselines.at(name);
+  size_t batch = 0;
+  if (auto batchNode = baseline.get("batch")) batch = std::stoul(batchNode->scalar);
+
+  if (batch == 0) {
+    // Grow the batch until a single sample takes at least minSampleTime
+    batch = 1;
+    for (;;) {
+      int64_t start = Util::Time::getTime();
+      for (size_t i = 0; i < batch; i++) runOnce();
+      int64_t elapsed = Util::Time::getTime() - start;
+      if (elapsed >= options.minSampleTime * (int64_t)Util::Time::millisecond) break;
+      batch = elapsed <= 0 ? batch * 10 : std::max(
+        batch + 1,
+        (size_t)((double)batch * (double)(options.minSampleTime * Util::Time::millisecond) / (double)elapsed * 1.2)
+      );
+    }
+  }
+
+  std::vector<double> samples;
+  for (int trial = 0; trial < options.trials; trial++) {
+    int64_t start = Util::Time::getTime();
+    for (size_t i = 0; i < batch; i++) runOnce();
+    samples.push_back((double)(Util::Time::getTime() - start) / (double)batch);
+  }
+
+  auto summary = Bench::summarize(samples);
+  std::cout
+    << "[" << name << "] median " << formatTime(summary.median)
+    << ", p95 " << formatTime(summary.p95)
+    << ", stddev " << formatTime(summary.stddev)
+    << " (" << options.trials << "x" << batch << ")";
+
+  std::vector<double> baselineSamples;
+  if (auto samplesNode = baseline.get("samples")) {
+    for (auto &sample : samplesNode->list) baselineSamples.push_back(std::stod(sample.scalar));
+  }
+
+  if (!baselineSamples.empty()) {
+    auto baselineSummary = Bench::summarize(baselineSamples);
+    double change = (summary.median - baselineSummary.median) / baselineSummary.median;
+    double p = Bench::mannWhitney(samples, baselineSamples);
+    char line[128];
+    snprintf(line, sizeof(line), " %+.1f%% p=%.4f", change * 100, p);
+    std::cout << line;
+    // Only flag changes that are both statistically significant and large enough to matter
+    if (p < options.alpha && change > options.threshold) {
+      std::cout << " REGRESSION";
+      outcome.regressed = true;
+    } else if (p < options.alpha && change < -options.threshold) {
+      std::cout << " improvement";
+    }
+  }
+  std::cout << std::endl;
+
+  if (options.update || baselineSamples.empty()) {
+    baseline.at("batch").scalar = std::to_string(batch);
+    Yaml::Node &samplesNode = baseline.at("samples");
+    samplesNode = Yaml::Node();
+    samplesNode.kind = Yaml::Node::K_LIST;
+    for (double sample : samples) {
+      Yaml::Node sampleNode;
+      sampleNode.scalar = std::to_string((int64_t)sample);
+      samplesNode.list.push_back(sampleNode);
+    }
+  }
+
+  return outcome;
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  bool help = false;
+
+  auto cli = (
+    option("-h", "--help").set(help) % "print this help message",
+    (option("-c", "--config") & value("file", options.configFile)) % "benchmark list\ndefault = config.yaml",
+    (option("-b", "--baseline") & value("file", options.baselineFile)) % "stored baseline samples\ndefault = benchmark_native.yaml",
+    (option("-f", "--filter") & value("text", options.filter)) % "only run benchmarks whose name contains text",
+    (option("-n", "--trials") & value("count", options.trials)) % "number of measured samples\ndefault = 30",
+    (option("-W", "--warmup") & value("count", options.warmup)) % "number of unmeasured runs\ndefault = 3",
+    (option("-t", "--time") & value("ms", options.minSampleTime)) % "minimum duration of one sample when calibrating\ndefault = 10",
+    (option("-a", "--alpha") & value("p", options.alpha)) % "significance level of the regression test\ndefault = 0.01",
+    (option("-r", "--threshold") & value("ratio", options.threshold)) % "smallest median slowdown reported as a regression\ndefault = 0.02",
+    (option("-m", "--memory") & value("size", options.memory)) % "tape memory to the left and right\ndefault = 0,65536",
+    option("-u", "--update").set(options.update) % "replace the stored baseline with this run"
+  );
+
+  if (!parse(argc, argv, cli) || help) {
+    std::cerr << "Usage:\n" << usage_lines(cli, "stackvm-runner") << std::endl;
+    std::cerr << "Parameters:\n" << documentation(cli) << std::endl;
+    return 1;
+  }
+
+  JIT::init();
+
+  auto config = Yaml::parse(readFile(options.configFile));
+  Yaml::Node baselineRoot;
+  if (std::filesystem::exists(options.baselineFile)) {
+    baselineRoot = Yaml::parse(readFile(options.baselineFile));
+  }
+  Yaml::Node &baselines = baselineRoot.at("benchmarks");
+
+  auto benchmarks = config.get("benchmarks");
+  if (benchmarks == nullptr || benchmarks->kind != Yaml::Node::K_LIST) {
+    std::cerr << "Error: \"" << options.configFile << "\" has no benchmark list" << std::endl;
+    return 1;
+  }
+
+  bool failed = false;
+  bool regressed = false;
+  for (auto &info : benchmarks->list) {
+    auto outcome = runBenchmark(options, info, baselines);
+    failed = failed || outcome.failed;
+    regressed = regressed || outcome.regressed;
+  }
+
+  std::ofstream file = Util::openFile(options.baselineFile, false);
+  file << Yaml::print(baselineRoot);
+  file.close();
+
+  return failed || regressed ? 1 : 0;
+}
@@ -0,0 +1,437 @@
+#include <array>
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <map>
+#include <clipp.h>
+
+#include "bench.h"
+#include "generator.h"
+#include "../src/bf.h"
+#include "../src/lowering.h"
+#include "../src/opt.h"
+#include "../src/report.h"
+#include "../src/jit.h"
+
+using namespace clipp;
+
+struct Shape {
+  const char *name;
+  Gen::Params (*params)(size_t length);
+};
+
+static const Shape shapes[] = {
+  {"straight", [](size_t length) {
+    Gen::Params params;
+    params.length = length;
+    return params;
+  }},
+  {"loops", [](size_t length) {
+    Gen::Params params;
+    params.length = length;
+    params.loops = length / 500 + 1;
+    params.depth = 4;
+    return params;
+  }},
+  {"deep", [](size_t length) {
+    Gen::Params params;
+    params.length = length;
+    params.loops = 1;
+    params.depth = std::min<size_t>(length / 20 + 1, 2000);
+    return params;
+  }},
+  {"seeks", [](size_t length) {
+    Gen::Params params;
+    params.length = length;
+    params.loops = length / 2000 + 1;
+    params.depth = 2;
+    params.seekComplexity = 3;
+    return params;
+  }},
+};
+
+struct Sample {
+  size_t size;
+  int64_t time;
+};
+
+static void dummyPutchar(void *context, int c) {}
+static int dummyGetchar(void *context) { return 0; }
+static void dummyWrite(void *context, const char *data, size_t size) {}
+
+// Times [fn] [repeat] times, keeping the fastest run, and measures the peak heap growth of the first run
+template<typename Fn>
+static std::pair<int64_t, size_t> measure(int repeat, Fn fn) {
+  int64_t best = INT64_MAX;
+  size_t peak = 0;
+  for (int i = 0; i < repeat; i++) {
+    Bench::Allocations::resetPeak();
+    size_t live = Bench::Allocations::current().live;
+    int64_t start = Util::Time::getTime();
+    fn(i == repeat - 1);
+    best = std::min(best, Util::Time::getTime() - start);
+    if (i == 0) peak = Bench::Allocations::current().peak - live;
+  }
+  return {best, peak};
+}
+
+// Pipelines of the compile budget cost model, as named by JIT::plan, and whether their expensive passes are skipped
+static const std::pair<const char*, bool> calibratedLevels[] = {
+  {"3", false}, {"3", true}, {"2", false}, {"2", true}, {"1", false}, {"1", true}, {"lean", false}, {"0", false},
+};
+
+// A program compiled by each pipeline: the terms of the cost model and the time taken
+struct CalibrationSample {
+  double modules = 0;
+  double insts = 0;
+  double nestedInsts = 0;
+  double time = 0;
+
+  [[nodiscard]] double term(int i) const { return i == 0 ? modules : i == 1 ? insts : nestedInsts; }
+
+  [[nodiscard]] double estimate(const std::array<double, 3> &costs) const {
+    return costs[0] * modules + costs[1] * insts + costs[2] * nestedInsts;
+  }
+};
+
+// Fits the costs of the terms of [samples] by weighted least squares, solving the normal equations by gaussian
+// elimination. Terms fitted a negative cost are left out and the others fitted again
+static std::array<double, 3> fitCosts(
+  const std::vector<CalibrationSample> &samples,
+  const std::vector<double> &weights
+) {
+  std::vector<int> terms{0, 1, 2};
+  while (true) {
+    size_t n = terms.size();
+    std::vector<std::vector<double>> m(n, std::vector<double>(n + 1));
+    for (size_t i = 0; i < samples.size(); i++) {
+      for (size_t row = 0; row < n; row++) {
+        for (size_t col = 0; col < n; col++) {
+          m[row][col] += weights[i] * samples[i].term(terms[row]) * samples[i].term(terms[col]);
+        }
+        m[row][n] += weights[i] * samples[i].term(terms[row]) * samples[i].time;
+      }
+    }
+    for (size_t pivot = 0; pivot < n; pivot++) {
+      for (size_t row = pivot + 1; row < n; row++) {
+        double factor = m[row][pivot] / m[pivot][pivot];
+        for (size_t col = pivot; col <= n; col++) m[row][col] -= factor * m[pivot][col];
+      }
+    }
+    std::array<double, 3> costs{};
+    for (size_t row = n; row-- > 0;) {
+      double rest = m[row][n];
+      for (size_t col = row + 1; col < n; col++) rest -= m[row][col] * costs[terms[col]];
+      costs[terms[row]] = rest / m[row][row];
+    }
+    if (std::erase_if(terms, [&](int term) { return costs[term] < 0; }) == 0) return costs;
+  }
+}
+
+// Times compiling generated programs with each pipeline and fits the cost model of JIT::plan:
+//   time = moduleCost * modules + instCost * insts + nestCost * nestedInsts
+// The fit minimizes the error of each sample relative to both its time and its estimate, so that estimating half and
+// twice the time taken weigh the same, by least squares reweighted with the estimates of the previous round
+static void calibrate(size_t minSize, size_t maxSize, int repeat, const std::string &shapeFilter) {
+  std::vector<std::unique_ptr<BFVM::Config>> configs;
+  std::vector<std::unique_ptr<JIT::Pipeline>> pipelines;
+  for (auto &[level, cheap] : calibratedLevels) {
+    auto config = std::make_unique<BFVM::Config>();
+    // Program modules are compiled one after the other, so that the time taken is the sum of their costs
+    config->splitSize = 0;
+    config->compileThreads = 1;
+    config->optLevel = level;
+    config->skipExpensivePasses = cheap;
+    auto jit = std::make_unique<JIT::Pipeline>(*config);
+    jit->addSymbol("bf_putchar", dummyPutchar);
+    jit->addSymbol("bf_getchar", dummyGetchar);
+    jit->addSymbol("bf_write", dummyWrite);
+    configs.push_back(std::move(config));
+    pipelines.push_back(std::move(jit));
+  }
+
+  std::vector<std::vector<CalibrationSample>> samples(std::size(calibratedLevels));
+  for (const Shape &shape : shapes) {
+    if (!shapeFilter.empty() && shapeFilter != shape.name) continue;
+
+    for (size_t size = minSize; size <= maxSize; size *= 4) {
+      BF::Program program = BF::Program::parse(Gen::generate(shape.params(size)));
+      auto graph = Lowering::buildProgram(*configs[0], program);
+      graph->buildDominators();
+      Opt::Pipeline pipeline(*configs[0]);
+      pipeline.runEarly(*graph);
+
+      // Measured as JIT::plan measures the graph, after the early passes
+      CalibrationSample terms;
+      for (auto &module : JIT::measureModules(*configs[0], program, nullptr, *graph, 0)) {
+        terms.modules++;
+        terms.insts += module.insts;
+        terms.nestedInsts += module.nestedInsts;
+      }
+      pipeline.runLate(*graph);
+
+      for (size_t i = 0; i < std::size(calibratedLevels); i++) {
+        CalibrationSample sample = terms;
+        sample.time = (double)measure(repeat, [&](bool) {
+          pipelines[i]->compile(*graph, "calibrate");
+        }).first;
+        samples[i].push_back(sample);
+
+        char line[160];
+        snprintf(
+          line,
+          sizeof(line),
+          "%-10s -O%-4s%-6s %10zu %10.0f insts %12.0f nested %14s",
+          shape.name,
+          calibratedLevels[i].first,
+          calibratedLevels[i].second ? " cheap" : "",
+          size,
+          sample.insts,
+          sample.nestedInsts,
+          Util::Time::printTime((int64_t)sample.time).c_str()
+        );
+        std::cout << line << std::endl;
+      }
+
+      graph->destroy();
+    }
+  }
+
+  // Printed as the entries of the cost table of JIT::plan, the cheap variants of the default pipelines only give the
+  // share of the time they take
+  std::cout << std::endl << "Fitted cost model:" << std::endl;
+  double cheapShares = 0;
+  int cheapCount = 0;
+  for (size_t i = 0; i < std::size(calibratedLevels); i++) {
+    if (calibratedLevels[i].second) {
+      for (size_t j = 0; j < samples[i].size(); j++) {
+        cheapShares += samples[i][j].time / samples[i - 1][j].time;
+        cheapCount++;
+      }
+      continue;
+    }
+
+    std::vector<double> weights;
+    for (const CalibrationSample &sample : samples[i]) weights.push_back(1 / (sample.time * sample.time));
+    std::array<double, 3> costs{};
+    double lowest = 0;
+    double highest = 0;
+    for (int round = 0; round < 30; round++) {
+      costs = fitCosts(samples[i], weights);
+      lowest = INFINITY;
+      highest = 0;
+      for (size_t j = 0; j < samples[i].size(); j++) {
+        const CalibrationSample &sample = samples[i][j];
+        double estimate = std::max(1.0, sample.estimate(costs));
+        weights[j] = 1 / (estimate * sample.time);
+        lowest = std::min(lowest, estimate / sample.time);
+        highest = std::max(highest, estimate / sample.time);
+      }
+    }
+
+    char line[160];
+    snprintf(
+      line,
+      sizeof(line),
+      "  {\"%s\", %.0f, %.1f, %.1f},  // estimates from %.2fx to %.2fx the time taken",
+      calibratedLevels[i].first,
+      costs[0],
+      costs[1],
+      costs[2],
+      lowest,
+      highest
+    );
+    std::cout << line << std::endl;
+  }
+  if (cheapCount != 0) {
+    std::cout << "cheapShare " << cheapShares / cheapCount << std::endl;
+  }
+}
+
+int main(int argc, char **argv) {
+  BFVM::Config config;
+
+  bool help = false;
+  size_t minSize = 1000;
+  size_t maxSize = 1000000;
+  size_t llvmMaxSize = 100000;
+  int repeat = 1;
+  bool calibrateCosts = false;
+  std::string shapeFilter;
+  std::string outputFile;
+  std::string emitDir;
+
+  auto cli = (
+    option("-h", "--help").set(help) % "print this help message",
+    (option("--min") & value("length", minSize)) % "smallest program length\ndefault = 1000",
+    (option("--max") & value("length", maxSize)) % "largest program length\ndefault = 1000000",
+    (option("--llvm-max") & value("length", llvmMaxSize)) % "largest program length translated to llvm\ndefault = 100000",
+    (option("-r", "--repeat") & value("count", repeat)) % "runs per stage, keeping the fastest\ndefault = 1",
+    (option("-s", "--shape") & value("name", shapeFilter)) % "only run the named program shape",
+    (option("-o", "--output") & value("file", outputFile)) % "writes samples as csv for plotting",
+    (option("-e", "--emit") & value("dir", emitDir)) % "writes each generated program into the specified folder",
+    option("-c", "--calibrate").set(calibrateCosts) % "fits the cost model of the compile budget, up to --llvm-max"
+  );
+
+  if (!parse(argc, argv, cli) || help || minSize == 0 || repeat < 1) {
+    std::cerr << "Usage:\n" << usage_lines(cli, "stackvm-scale") << std::endl;
+    std::cerr << "Parameters:\n" << documentation(cli) << std::endl;
+    return 1;
+  }
+
+  JIT::init();
+  if (calibrateCosts) {
+    calibrate(minSize, llvmMaxSize, repeat, shapeFilter);
+    return 0;
+  }
+
+  JIT::Pipeline jit(config);
+  jit.addSymbol("bf_putchar", dummyPutchar);
+  jit.addSymbol("bf_getchar", dummyGetchar);
+  jit.addSymbol("bf_write", dummyWrite);
+
+  std::ofstream csv;
+  if (!outputFile.empty()) {
+    csv = Util::openFile(outputFile, false);
+    csv << "shape,size,insts,stage,time,peak\n";
+  }
+
+  // Samples per shape and stage, for estimating how each stage scales
+  std::map<std::string, std::vector<Sample>> samples;
+  std::vector<std::string> order;
+
+  for (const Shape &shape : shapes) {
+    if (!shapeFilter.empty() && shapeFilter != shape.name) continue;
+
+    for (size_t size = minSize; size <= maxSize; size *= 4) {
+      std::string code = Gen::generate(shape.params(size));
+      if (!emitDir.empty()) {
+        std::ofstream file = Util::openFile(emitDir + "/" + shape.name + "_" + std::to_string(size) + ".b", false);
+        file << code;
+      }
+
+      std::unique_ptr<IR::Graph> graph;
+      BF::Program program;
+      size_t insts = 0;
+
+      auto record = [&](const std::string &stage, std::pair<int64_t, size_t> result) {
+        std::string key = std::string(shape.name) + "/" + stage;
+        if (!samples.count(key)) order.push_back(key);
+        samples[key].push_back({size, result.first});
+        if (csv.is_open()) {
+          csv << shape.name << "," << size << "," << insts << "," << stage << ","
+            << result.first << "," << result.second << "\n";
+        }
+        char line[160];
+        snprintf(
+          line,
+          sizeof(line),
+          "%-24s %10zu %10zu insts %14s %12zu KiB peak",
+          key.c_str(),
+          size,
+          insts,
+          Util::Time::printTime(result.first).c_str(),
+          result.second / 1024
+        );
+        std::cout << line << std::endl;
+      };
+
+      record("parse", measure(repeat, [&](bool keep) {
+        auto parsed = BF::Program::parse(code);
+        if (keep) program = std::move(parsed);
+      }));
+
+      // Graph mutating stages are measured once, there is no cheap way to restore their input
+      record("lower", measure(1, [&](bool) {
+        graph = Lowering::buildProgram(config, program);
+      }));
+      insts = Report::measure(*graph).insts;
+
+      record("dominators", measure(1, [&](bool) {
+        graph->buildDominators();
+      }));
+
+      record("resolve_regs", measure(1, [&](bool) {
+        Opt::resolveRegs(*graph);
+      }));
+
+      record("fold", measure(1, [&](bool) {
+        Opt::fold(*graph, Opt::standardFoldRules());
+      }));
+
+      record("constants", measure(1, [&](bool) {
+        Opt::propagateConstants(*graph);
+      }));
+
+      record("cfg", measure(1, [&](bool) {
+        Opt::simplifyCFG(*graph);
+      }));
+
+      record("counted", measure(1, [&](bool) {
+        Opt::evaluateCountedLoops(*graph);
+      }));
+
+      record("if_loops", measure(1, [&](bool) {
+        Opt::convertIfLoops(*graph);
+      }));
+
+      record("loops", measure(1, [&](bool) {
+        Opt::optimizeLoops(*graph);
+      }));
+
+      record("memory", measure(1, [&](bool) {
+        Opt::optimizeMemory(*graph);
+      }));
+
+      record("inductions", measure(1, [&](bool) {
+        Opt::optimizeInductions(*graph);
+      }));
+
+      record("common_expr", measure(1, [&](bool) {
+        Opt::optimizeCommonExpr(*graph);
+      }));
+
+      record("rotate", measure(1, [&](bool) {
+        Opt::rotateLoops(*graph);
+      }));
+
+      record("bulk_memory", measure(1, [&](bool) {
+        Opt::lowerBulkMemory(*graph);
+      }));
+
+      if (size <= llvmMaxSize) {
+        record("compile_graph", measure(1, [&](bool) {
+          auto module = std::make_unique<llvm::Module>("scale", jit.context);
+          Backend::LLVM::ModuleCompiler compiler(config, *jit.machine, jit.context, *module);
+          compiler.compileGraph(*graph, "scale");
+        }));
+      }
+
+      graph->destroy();
+      graph.reset();
+    }
+  }
+
+  // Fit log(time) = k * log(size) + c, k is roughly the exponent of each stage's complexity
+  std::cout << std::endl << "Scaling exponents:" << std::endl;
+  for (const std::string &key : order) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int n = 0;
+    for (const Sample &sample : samples[key]) {
+      // Ignore samples dominated by fixed costs and timer noise
+      if (sample.time < (int64_t)Util::Time::millisecond) continue;
+      double x = std::log((double)sample.size);
+      double y = std::log((double)sample.time);
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+      n++;
+    }
+    if (n < 2) continue;
+    double k = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    char line[96];
+    snprintf(line, sizeof(line), "%-24s %5.2f%s", key.c_str(), k, k > 1.25 ? "  superlinear" : "");
+    std::cout << line << std::endl;
+  }
+}
@@ -0,0 +1,69 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "sha1.h"
+
+static uint32_t rotl(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+std::string Bench::sha1(const std::string &data) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+  std::string message = data;
+  uint64_t bitLength = (uint64_t)data.size() * 8;
+  message.push_back((char)0x80);
+  while (message.size() % 64 != 56) {
+    message.push_back(0);
+  }
+  for (int i = 7; i >= 0; i--) {
+    message.push_back((char)(bitLength >> (i * 8)));
+  }
+
+  for (size_t chunk = 0; chunk < message.size(); chunk += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+      auto byte = [&](int j) { return (uint32_t)(uint8_t)message[chunk + i * 4 + j]; };
+      w[i] = (byte(0) << 24) | (byte(1) << 16) | (byte(2) << 8) | byte(3);
+    }
+    for (int i = 16; i < 80; i++) {
+      w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  char out[41];
+  for (int i = 0; i < 5; i++) {
+    snprintf(out + i * 8, 9, "%08x", h[i]);
+  }
+  return std::string(out, 40);
+}
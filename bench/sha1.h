@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+namespace Bench {
+  // Hex encoded SHA-1 digest, matching the output hashes recorded in config.yaml
+  std::string sha1(const std::string &data);
+}
@@ -0,0 +1,286 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <clipp.h>
+
+#include "bench.h"
+#include "generator.h"
+#include "../src/bf.h"
+#include "../src/lowering.h"
+#include "../src/eval.h"
+#include "../src/opt.h"
+#include "../src/jit.h"
+
+using namespace clipp;
+
+struct Input {
+  std::string name;
+  std::string code;
+};
+
+static const char *sampleNames[] = {
+  "hello",
+  "harmonic",
+  "mandlebrot",
+  "self_interpreter",
+  "semihash",
+  "sierpinski",
+  "signedmath",
+  "synthetic_alias",
+};
+
+static void dummyPutchar(void *context, int c) {}
+static int dummyGetchar(void *context) { return 0; }
+static void dummyWrite(void *context, const char *data, size_t size) {}
+
+static std::vector<Input> loadInputs(const std::string &sampleDir) {
+  std::vector<Input> inputs;
+  for (const char *name : sampleNames) {
+    std::ifstream file(sampleDir + "/" + name + ".b");
+    if (!file.is_open()) {
+      std::cerr << "Error: Failed to open sample \"" << name << "\" in \"" << sampleDir << "\"" << std::endl;
+      std::exit(1);
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    inputs.push_back({name, contents.str()});
+  }
+  Gen::Params straight;
+  straight.length = 100000;
+  inputs.push_back({"gen_straight_100k", Gen::generate(straight)});
+  Gen::Params nested;
+  nested.length = 20000;
+  nested.loops = 1;
+  nested.depth = 200;
+  inputs.push_back({"gen_nested_200", Gen::generate(nested)});
+  return inputs;
+}
+
+// Builds a graph for [code] up to, but not including, the named stage
+static std::unique_ptr<IR::Graph> prepareGraph(const BFVM::Config &config, const std::string &code, int stage) {
+  auto program = BF::Program::parse(code);
+  auto graph = Lowering::buildProgram(config, program);
+  graph->buildDominators();
+  if (stage > 0) Opt::resolveRegs(*graph);
+  if (stage > 1) Opt::fold(*graph, Opt::standardFoldRules());
+  if (stage > 2) Opt::propagateConstants(*graph);
+  if (stage > 3) Opt::simplifyCFG(*graph);
+  if (stage > 4) Opt::evaluateCountedLoops(*graph);
+  if (stage > 5) Opt::convertIfLoops(*graph);
+  if (stage > 6) Opt::optimizeLoops(*graph);
+  if (stage > 7) Opt::optimizeMemory(*graph);
+  if (stage > 8) Opt::optimizeInductions(*graph);
+  if (stage > 9) Opt::optimizeCommonExpr(*graph);
+  if (stage > 10) Opt::rotateLoops(*graph);
+  return graph;
+}
+
+static void addStages(Bench::Suite &suite, const BFVM::Config &config, JIT::Pipeline &jit, const Input &input) {
+  const std::string &code = input.code;
+
+  suite.add("parse/" + input.name, [&code](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      state.start();
+      auto program = BF::Program::parse(code);
+      state.stop();
+    }
+  });
+
+  suite.add("evaluate/" + input.name, [&code, &config](Bench::State &state) {
+    auto program = BF::Program::parse(code);
+    for (size_t i = 0; i < state.iterations; i++) {
+      state.start();
+      auto prefix = Eval::run(config, program);
+      state.stop();
+    }
+  });
+
+  suite.add("lower/" + input.name, [&code, &config](Bench::State &state) {
+    auto program = BF::Program::parse(code);
+    for (size_t i = 0; i < state.iterations; i++) {
+      state.start();
+      auto graph = Lowering::buildProgram(config, program);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("resolve_regs/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 0);
+      state.start();
+      Opt::resolveRegs(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("fold/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 1);
+      state.start();
+      Opt::fold(*graph, Opt::standardFoldRules());
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("constants/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 2);
+      state.start();
+      Opt::propagateConstants(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("cfg/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 3);
+      state.start();
+      Opt::simplifyCFG(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("counted/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 4);
+      state.start();
+      Opt::evaluateCountedLoops(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("if_loops/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 5);
+      state.start();
+      Opt::convertIfLoops(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("loops/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 6);
+      state.start();
+      Opt::optimizeLoops(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("memory/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 7);
+      state.start();
+      Opt::optimizeMemory(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("inductions/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 8);
+      state.start();
+      Opt::optimizeInductions(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("common_expr/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 9);
+      state.start();
+      Opt::optimizeCommonExpr(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("rotate/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 10);
+      state.start();
+      Opt::rotateLoops(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("bulk_memory/" + input.name, [&code, &config](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 11);
+      state.start();
+      Opt::lowerBulkMemory(*graph);
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("compile_graph/" + input.name, [&code, &config, &jit](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 2);
+      auto module = std::make_unique<llvm::Module>("bench", jit.context);
+      Backend::LLVM::ModuleCompiler compiler(config, *jit.machine, jit.context, *module);
+      state.start();
+      compiler.compileGraph(*graph, "bench");
+      state.stop();
+      graph->destroy();
+    }
+  });
+
+  suite.add("jit_compile/" + input.name, [&code, &config, &jit](Bench::State &state) {
+    for (size_t i = 0; i < state.iterations; i++) {
+      auto graph = prepareGraph(config, code, 2);
+      state.start();
+      auto handle = jit.compile(*graph, "bench");
+      state.stop();
+      graph->destroy();
+    }
+  });
+}
+
+int main(int argc, char **argv) {
+  BFVM::Config config;
+
+  bool help = false;
+  std::string filter;
+  std::string sampleDir = "samples";
+  int64_t minTime = 200;
+
+  auto cli = (
+    option("-h", "--help").set(help) % "print this help message",
+    (option("-f", "--filter") & value("text", filter)) % "only run benchmarks whose name contains text",
+    (option("-t", "--time") & value("ms", minTime)) % "minimum measured time per benchmark\ndefault = 200",
+    (option("-s", "--samples") & value("dir", sampleDir)) % "directory containing the sample programs\ndefault = samples",
+    (option("-w", "--width") & value("bits", config.cellWidth)) % "width of cells in bits\ndefault = 8"
+  );
+
+  if (!parse(argc, argv, cli) || help) {
+    std::cerr << "Usage:\n" << usage_lines(cli, "stackvm-bench") << std::endl;
+    std::cerr << "Parameters:\n" << documentation(cli) << std::endl;
+    return 1;
+  }
+
+  JIT::init();
+  JIT::Pipeline jit(config);
+  jit.addSymbol("bf_putchar", dummyPutchar);
+  jit.addSymbol("bf_getchar", dummyGetchar);
+  jit.addSymbol("bf_write", dummyWrite);
+
+  auto inputs = loadInputs(sampleDir);
+
+  Bench::Suite suite(minTime * Util::Time::millisecond);
+  for (const Input &input : inputs) {
+    addStages(suite, config, jit, input);
+  }
+  suite.run(filter);
+}
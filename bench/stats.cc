@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <cmath>
+
+#include "stats.h"
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t rank = (size_t)std::ceil(p * (double)sorted.size());
+  return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+Bench::Summary Bench::summarize(std::vector<double> samples) {
+  Summary summary;
+  if (samples.empty()) return summary;
+  std::sort(samples.begin(), samples.end());
+
+  size_t n = samples.size();
+  summary.median = n % 2 == 1 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  summary.p95 = percentile(samples, 0.95);
+
+  double sum = 0;
+  for (double sample : samples) sum += sample;
+  summary.mean = sum / (double)n;
+
+  double squares = 0;
+  for (double sample : samples) squares += (sample - summary.mean) * (sample - summary.mean);
+  summary.stddev = n < 2 ? 0 : std::sqrt(squares / (double)(n - 1));
+
+  return summary;
+}
+
+double Bench::mannWhitney(const std::vector<double> &a, const std::vector<double> &b) {
+  size_t n1 = a.size();
+  size_t n2 = b.size();
+  if (n1 == 0 || n2 == 0) return 1;
+
+  struct Ranked {
+    double value;
+    bool first;
+  };
+
+  std::vector<Ranked> all;
+  for (double value : a) all.push_back({value, true});
+  for (double value : b) all.push_back({value, false});
+  std::sort(all.begin(), all.end(), [](const Ranked &x, const Ranked &y) { return x.value < y.value; });
+
+  // Assign average ranks to ties, accumulating the tie correction term
+  double rankSum = 0;
+  double tieTerm = 0;
+  size_t n = all.size();
+  for (size_t i = 0; i < n;) {
+    size_t j = i;
+    while (j < n && all[j].value == all[i].value) j++;
+    double rank = (double)(i + 1 + j) / 2;
+    for (size_t k = i; k < j; k++) {
+      if (all[k].first) rankSum += rank;
+    }
+    double t = (double)(j - i);
+    tieTerm += t * t * t - t;
+    i = j;
+  }
+
+  double u = rankSum - (double)n1 * (double)(n1 + 1) / 2;
+  double mu = (double)n1 * (double)n2 / 2;
+  double variance = (double)n1 * (double)n2 / 12 * (((double)n + 1) - tieTerm / ((double)n * (double)(n - 1)));
+  if (variance <= 0) return 1;
+
+  // Normal approximation with continuity correction
+  double z = (std::abs(u - mu) - 0.5) / std::sqrt(variance);
+  if (z < 0) z = 0;
+  return std::erfc(z / std::sqrt(2.0));
+}
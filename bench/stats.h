@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+
+namespace Bench {
+  struct Summary {
+    double median = 0;
+    double p95 = 0;
+    double mean = 0;
+    double stddev = 0;
+  };
+
+  Summary summarize(std::vector<double> samples);
+
+  // Two-sided p-value of a Mann-Whitney U test, the probability that both sample sets share a distribution
+  double mannWhitney(const std::vector<double> &a, const std::vector<double> &b);
+}
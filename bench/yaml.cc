@@ -0,0 +1,237 @@
+#include <iostream>
+
+#include "yaml.h"
+
+using namespace Yaml;
+
+struct Line {
+  size_t indent;
+  std::string text;
+};
+
+static std::string trim(const std::string &str) {
+  size_t start = str.find_first_not_of(" \t");
+  if (start == std::string::npos) return "";
+  size_t end = str.find_last_not_of(" \t");
+  return str.substr(start, end - start + 1);
+}
+
+static std::string unquote(const std::string &str) {
+  if (str.size() >= 2 && (str.front() == '"' || str.front() == '\'') && str.back() == str.front()) {
+    return str.substr(1, str.size() - 2);
+  }
+  return str;
+}
+
+static Node parseScalar(const std::string &text) {
+  Node node;
+  std::string value = trim(text);
+  if (value.size() >= 2 && value.front() == '[' && value.back() == ']') {
+    node.kind = Node::K_LIST;
+    std::string inner = value.substr(1, value.size() - 2);
+    size_t pos = 0;
+    while (pos < inner.size()) {
+      size_t comma = inner.find(',', pos);
+      if (comma == std::string::npos) comma = inner.size();
+      std::string item = trim(inner.substr(pos, comma - pos));
+      if (!item.empty()) {
+        Node child;
+        child.scalar = unquote(item);
+        node.list.push_back(child);
+      }
+      pos = comma + 1;
+    }
+  } else {
+    node.scalar = unquote(value);
+  }
+  return node;
+}
+
+// Finds the colon separating a map key from its value, or npos if [text] is not a map entry
+static size_t findKeySeparator(const std::string &text) {
+  char quote = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if (quote) {
+      if (c == quote) quote = 0;
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+    } else if (c == ':' && (i + 1 == text.size() || text[i + 1] == ' ')) {
+      return i;
+    }
+  }
+  return std::string::npos;
+}
+
+static bool isListItem(const std::string &text) {
+  return text == "-" || text.rfind("- ", 0) == 0;
+}
+
+struct Parser {
+  std::vector<Line> lines;
+  size_t pos = 0;
+
+  explicit Parser(const std::string &text) {
+    size_t start = 0;
+    while (start <= text.size()) {
+      size_t end = text.find('\n', start);
+      if (end == std::string::npos) end = text.size();
+      std::string raw = text.substr(start, end - start);
+      if (!raw.empty() && raw.back() == '\r') raw.pop_back();
+      size_t comment = raw.find(" #");
+      if (raw.rfind('#', 0) == 0) raw.clear();
+      if (comment != std::string::npos) raw = raw.substr(0, comment);
+      size_t indent = raw.find_first_not_of(' ');
+      if (indent != std::string::npos && !trim(raw).empty()) {
+        lines.push_back({indent, trim(raw)});
+      }
+      start = end + 1;
+    }
+  }
+
+  Node parseBlock(size_t indent) {
+    if (pos == lines.size()) return {};
+    if (isListItem(lines[pos].text)) {
+      return parseList(lines[pos].indent);
+    } else {
+      return parseMap(indent);
+    }
+  }
+
+  Node parseList(size_t indent) {
+    Node node;
+    node.kind = Node::K_LIST;
+    while (pos < lines.size() && lines[pos].indent == indent && isListItem(lines[pos].text)) {
+      std::string rest = lines[pos].text == "-" ? "" : trim(lines[pos].text.substr(2));
+      if (rest.empty()) {
+        pos++;
+        if (pos < lines.size() && lines[pos].indent > indent) {
+          node.list.push_back(parseBlock(lines[pos].indent));
+        } else {
+          node.list.emplace_back();
+        }
+      } else if (findKeySeparator(rest) != std::string::npos) {
+        // An inline map, the item's remaining keys are aligned with its first key
+        size_t itemIndent = indent + (lines[pos].text.size() - rest.size());
+        lines[pos] = {itemIndent, rest};
+        node.list.push_back(parseMap(itemIndent));
+      } else {
+        pos++;
+        node.list.push_back(parseScalar(rest));
+      }
+    }
+    return node;
+  }
+
+  Node parseMap(size_t indent) {
+    Node node;
+    node.kind = Node::K_MAP;
+    while (pos < lines.size() && lines[pos].indent == indent && !isListItem(lines[pos].text)) {
+      const std::string &text = lines[pos].text;
+      size_t separator = findKeySeparator(text);
+      if (separator == std::string::npos) {
+        std::cerr << "Error: Expected a key on line \"" << text << "\"" << std::endl;
+        std::exit(1);
+      }
+      std::string key = unquote(trim(text.substr(0, separator)));
+      std::string value = trim(text.substr(separator + 1));
+      pos++;
+      if (!value.empty()) {
+        node.map.emplace_back(key, parseScalar(value));
+      } else if (
+        pos < lines.size() &&
+        (lines[pos].indent > indent || (lines[pos].indent == indent && isListItem(lines[pos].text)))
+      ) {
+        node.map.emplace_back(key, parseBlock(lines[pos].indent));
+      } else {
+        node.map.emplace_back(key, Node());
+      }
+    }
+    return node;
+  }
+};
+
+const Node *Node::get(const std::string &key) const {
+  for (auto &entry : map) {
+    if (entry.first == key) return &entry.second;
+  }
+  return nullptr;
+}
+
+Node &Node::at(const std::string &key) {
+  kind = K_MAP;
+  for (auto &entry : map) {
+    if (entry.first == key) return entry.second;
+  }
+  return map.emplace_back(key, Node()).second;
+}
+
+Node Yaml::parse(const std::string &text) {
+  Parser parser(text);
+  if (parser.lines.empty()) return {};
+  return parser.parseBlock(parser.lines[0].indent);
+}
+
+static std::string printScalar(const std::string &str) {
+  if (
+    str.empty() ||
+    str.find_first_of(":#[],'\"") != std::string::npos ||
+    str.front() == ' ' ||
+    str.back() == ' ' ||
+    str.front() == '-'
+  ) {
+    return "\"" + str + "\"";
+  }
+  return str;
+}
+
+// Whether a node is printed on the same line as its key or list marker
+static bool isInline(const Node &node) {
+  if (node.kind == Node::K_MAP) return false;
+  for (auto &child : node.list) {
+    if (child.kind != Node::K_SCALAR) return false;
+  }
+  return true;
+}
+
+static void printNode(std::string &out, const Node &node, size_t indent) {
+  std::string pad(indent, ' ');
+  if (node.kind == Node::K_SCALAR) {
+    out += printScalar(node.scalar) + "\n";
+  } else if (isInline(node)) {
+    out += "[";
+    for (size_t i = 0; i < node.list.size(); i++) {
+      if (i != 0) out += ", ";
+      out += printScalar(node.list[i].scalar);
+    }
+    out += "]\n";
+  } else if (node.kind == Node::K_LIST) {
+    for (auto &child : node.list) {
+      out += pad + "-";
+      if (isInline(child)) {
+        out += " ";
+        printNode(out, child, indent + 2);
+      } else {
+        out += "\n";
+        printNode(out, child, indent + 2);
+      }
+    }
+  } else {
+    for (auto &entry : node.map) {
+      out += pad + printScalar(entry.first) + ":";
+      if (isInline(entry.second)) {
+        out += " ";
+        printNode(out, entry.second, indent + 2);
+      } else {
+        out += "\n";
+        printNode(out, entry.second, indent + 2);
+      }
+    }
+  }
+}
+
+std::string Yaml::print(const Node &node) {
+  std::string out;
+  printNode(out, node, 0);
+  return out;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+// A small YAML subset covering config.yaml and benchmark baselines: block maps, block lists, plain or quoted
+// scalars and flow lists of scalars.
+namespace Yaml {
+  struct Node {
+    enum Kind {
+      K_SCALAR,
+      K_LIST,
+      K_MAP,
+    };
+
+    Kind kind = K_SCALAR;
+    std::string scalar;
+    std::vector<Node> list;
+    std::vector<std::pair<std::string, Node>> map;
+
+    // Returns the value of [key] in a map, or null if it does not exist
+    [[nodiscard]] const Node *get(const std::string &key) const;
+
+    // Returns the value of [key] in a map, inserting an empty scalar if it does not exist
+    Node &at(const std::string &key);
+
+    [[nodiscard]] bool isNull() const { return kind == K_SCALAR && scalar.empty(); }
+  };
+
+  Node parse(const std::string &text);
+  std::string print(const Node &node);
+}
@@ -34,10 +34,19 @@ int main(int argc, char** argv) {
     (option("-w", "--width") & value("bits", config.cellWidth)) % "width of cells in bits\ndefault = 8",
     (option("-e", "--eof") & value("value", config.cellWidth)) % "value of getchar when eof is reached\ndefault = 0",
     (option("-m", "--memory") & value("size", memory)) % "how much virtual memory (in bytes) to reserve to the left and right\ndefault = 128MiB,128MiB",
+    (option("-b", "--budget") & value("steps", config.evalBudget)) % "how many instructions to evaluate at compile time before the first input, 0 disables\ndefault = 1000000",
+    (option("-s", "--split") & value("size", config.splitSize)) % "compile loops of at least this many instructions as functions of their own, 0 disables\ndefault = 8192",
+    (option("-j", "--jobs") & value("threads", config.compileThreads)) % "how many threads compile the functions of a program, 0 uses every core\ndefault = 0",
+    option("-l", "--lazy").set(config.lazy) % "compile each function of a program when it first runs",
+    (option("-O", "--opt") & value("level", config.optLevel)) % "LLVM optimization pipeline, 0 to 3 or lean\ndefault = 2",
+    (option("-c", "--compile-budget") & value("ms", config.compileBudget)) % "how long compiling may take, cheaper optimizations are picked to fit, 0 disables\ndefault = 0",
+    (option("--cpu") & value("name", config.cpu)) % "the CPU to generate code for, generic for a baseline any x86-64 runs\ndefault = the host CPU",
+    (option("--features") & value("list", config.cpuFeatures)) % "target features to enable or disable on top of those of the CPU, such as +avx2,-avx512f",
 #ifndef NDIAG
     (option("-p", "--profile") & value("count", config.profile)) % "do the specified number of profile runs",
     option("-q", "--quiet").set(config.quiet) % "suppress printing profiling info to the console",
     (option("-d", "--dump") & value("dir", config.dump)) % "dumps intermediates into the specified folder",
+    (option("-r", "--report") & value("file", config.report)) % "writes a JSON report of per-pass compile statistics",
 #endif
     value("program").set(program)
   );
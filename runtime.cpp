@@ -5,6 +5,7 @@ extern "C" {
   char *code(void *context, char *mem);
   void bf_putchar(void *context, int c);
   int bf_getchar(void *context);
+  void bf_write(void *context, const char *data, size_t size);
 }
 
 void bf_putchar(void *context, int c) {
@@ -17,6 +18,10 @@ int bf_getchar(void *context) {
   return c;
 }
 
+void bf_write(void *context, const char *data, size_t size) {
+  fwrite(data, 1, size, stdout);
+}
+
 int main(int argc, char **argv) {
   auto mem = static_cast<char*>(calloc(4096, 1));
   code(nullptr, mem);
@@ -0,0 +1,9 @@
+Reads input right after the divmod and compare idioms so that their joins start with a getchar
+
+Divides the first character by five then reads the second one over it and prints it with the quotient and remainder
+,>>+++++<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<],.
+>>>>++++++++++++++++++++++++++++++++++++++++++++++++.<++++++++++++++++++++++++++++++++++++++++++++++++.
+
+Compares the third character with ten then reads and prints the fourth one
+>>>>>>>>,>++++++++++<[->-[>]<<],.
+[-]++++++++++.
@@ -6,10 +6,19 @@
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IR/Mangler.h>
+#include <llvm/IR/PassTimingInfo.h>
+#include <llvm/Pass.h>
 #include <llvm/Passes/PassBuilder.h>
-#include <llvm/Transforms/IPO.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Passes/StandardInstrumentations.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopDeletion.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
 #include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/Timer.h>
 
 #include "backend_llvm.h"
 #include "opt.h"
@@ -25,7 +34,6 @@ Backend::LLVM::ModuleCompiler::ModuleCompiler(
   builder(context),
   context(context),
   module(module),
-  functionPassManager(&module),
   regValues{nullptr}
 {
   intType = llvm::Type::getInt32Ty(context);
@@ -66,6 +74,19 @@ Backend::LLVM::ModuleCompiler::ModuleCompiler(
     module
   );
 
+  writeType = llvm::FunctionType::get(
+    voidType,
+    {contextPtrType, llvm::Type::getInt8PtrTy(context), sizeType},
+    false
+  );
+
+  writeFunction = llvm::Function::Create(
+    writeType,
+    llvm::Function::ExternalLinkage,
+    "bf_write",
+    module
+  );
+
   fragmentType = llvm::FunctionType::get(
     cellPtrType,
     {contextPtrType, cellPtrType},
@@ -74,46 +95,179 @@ Backend::LLVM::ModuleCompiler::ModuleCompiler(
 }
 
 void Backend::LLVM::ModuleCompiler::optimize() {
+  optimizeModule(module, machine, config, report);
+}
+
+bool Backend::LLVM::isOptLevel(const std::string &level) {
+  return level == "0" || level == "1" || level == "2" || level == "3" || level == "lean";
+}
+
+// Moves the LLVM pass timers collected so far into [report], adding them to the ones of earlier modules by name
+static void collectTimers(Report::Compile &report) {
+  std::string values;
+  llvm::raw_string_ostream stream(values);
+  llvm::TimerGroup::printAllJSONValues(stream, "");
+  stream.flush();
+  // Each timer is printed as a "name": value member, names never contain quotes
+  size_t start = values.find('"');
+  while (start != std::string::npos) {
+    size_t end = values.find('"', start + 1);
+    size_t colon = values.find(':', end);
+    report.llvmTimers[values.substr(start + 1, end - start - 1)] += std::strtod(values.c_str() + colon + 1, nullptr);
+    start = values.find('"', colon);
+  }
+  // Clearing the timers also stops llvm from printing them at exit
+  llvm::TimerGroup::clearAll();
+}
+
+// Promotes the register allocas to values, then cleans up the arithmetic and hoists what the IR passes left in loops.
+// Everything else the default pipelines do, such as inlining or loop unrolling, is already done by the IR passes or
+// finds nothing in the code they leave
+static llvm::ModulePassManager buildLeanPipeline() {
+  llvm::LoopPassManager loopPassManager;
+  loopPassManager.addPass(llvm::LICMPass());
+  loopPassManager.addPass(llvm::LoopDeletionPass());
+
+  llvm::FunctionPassManager functionPassManager;
+  functionPassManager.addPass(llvm::PromotePass());
+  functionPassManager.addPass(llvm::InstCombinePass());
+  functionPassManager.addPass(llvm::SimplifyCFGPass());
+  functionPassManager.addPass(llvm::createFunctionToLoopPassAdaptor(std::move(loopPassManager), true));
+  functionPassManager.addPass(llvm::GVN());
+  functionPassManager.addPass(llvm::InstCombinePass());
+  functionPassManager.addPass(llvm::SimplifyCFGPass());
+
+  llvm::ModulePassManager passManager;
+  passManager.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(functionPassManager)));
+  return passManager;
+}
+
+void Backend::LLVM::optimizeModule(
+  llvm::Module &module,
+  llvm::TargetMachine &machine,
+  const BFVM::Config &config,
+  Report::Compile *report
+) {
   if (verifyModule(module, &llvm::errs())) abort();
 
   module.setTargetTriple(machine.getTargetTriple().str());
   module.setDataLayout(machine.createDataLayout());
 
-  {
-    llvm::PassManagerBuilder managerBuilder;
-    managerBuilder.OptLevel = 2;
-    managerBuilder.SizeLevel = 0;
-    managerBuilder.Inliner = llvm::createFunctionInliningPass(2, 0, false);
-    managerBuilder.LoopVectorize = true;
-    managerBuilder.SLPVectorize = true;
-    machine.adjustPassManager(managerBuilder);
-    managerBuilder.populateFunctionPassManager(functionPassManager);
-    managerBuilder.populateModulePassManager(passManager);
-  }
+  llvm::PassInstrumentationCallbacks callbacks;
+  llvm::StandardInstrumentations instrumentations;
+  instrumentations.registerCallbacks(callbacks);
+
+  // Our own pipeline is timed by a handler of its own rather than through llvm::TimePassesIsEnabled, a plain global
+  // which the code generators of modules emitted on other compile threads read while this one is optimized
+  llvm::TimePassesHandler timePasses(report != nullptr);
+  timePasses.registerCallbacks(callbacks);
+
+  // Vectorizing and unrolling loops take a large share of the default pipelines
+  llvm::PipelineTuningOptions tuning;
+  tuning.LoopVectorization = !config.skipExpensivePasses;
+  tuning.SLPVectorization = !config.skipExpensivePasses;
+  tuning.LoopUnrolling = !config.skipExpensivePasses;
+  llvm::PassBuilder passBuilder(&machine, tuning, llvm::None, &callbacks);
 
-  functionPassManager.doInitialization();
-  for (llvm::Function &func : module) {
-    if (verifyFunction(func, &llvm::errs())) abort();
-    functionPassManager.run(func);
+  llvm::LoopAnalysisManager loopAnalyses;
+  llvm::FunctionAnalysisManager functionAnalyses;
+  llvm::CGSCCAnalysisManager cgsccAnalyses;
+  llvm::ModuleAnalysisManager moduleAnalyses;
+  passBuilder.registerModuleAnalyses(moduleAnalyses);
+  passBuilder.registerCGSCCAnalyses(cgsccAnalyses);
+  passBuilder.registerFunctionAnalyses(functionAnalyses);
+  passBuilder.registerLoopAnalyses(loopAnalyses);
+  passBuilder.crossRegisterProxies(loopAnalyses, functionAnalyses, cgsccAnalyses, moduleAnalyses);
+
+  // The default pipelines refuse to run at O0, which only verifies
+  const std::string &level = config.optLevel;
+  llvm::ModulePassManager passManager;
+  if (level == "1") {
+    passManager = passBuilder.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O1);
+  } else if (level == "2") {
+    passManager = passBuilder.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O2);
+  } else if (level == "3") {
+    passManager = passBuilder.buildPerModuleDefaultPipeline(llvm::PassBuilder::OptimizationLevel::O3);
+  } else if (level == "lean") {
+    passManager = buildLeanPipeline();
+  } else if (level != "0") {
+    std::cerr << "Error: Unknown optimization level \"" << level << "\"" << std::endl;
+    std::exit(1);
   }
-  functionPassManager.doFinalization();
+  passManager.addPass(llvm::VerifierPass());
+  passManager.run(module, moduleAnalyses);
 
-  passManager.add(llvm::createVerifierPass());
-  passManager.run(module);
+  if (report != nullptr) collectTimers(*report);
 }
 
 void Backend::LLVM::ModuleCompiler::compileGraph(IR::Graph &graph, const std::string &name) {
-  graph.clearPassData();
+  DIAG(eventStart, "Translate")
+
+  // Functions are declared up front, as any of them may call the others
+  functions.clear();
+  for (size_t i = 0; i < graph.functions.size(); i++) {
+    auto function = createFragment(name + "." + std::to_string(i), llvm::Function::InternalLinkage);
+    // Outlined loops occur several times, inlining them would undo the outlining
+    function->addFnAttr(llvm::Attribute::NoInline);
+    functions.push_back(function);
+  }
+
+  compileFunction(graph, createFragment(name, llvm::Function::ExternalLinkage));
+  for (size_t i = 0; i < graph.functions.size(); i++) {
+    compileFunction(*graph.functions[i], functions[i]);
+  }
+
+  DIAG(eventFinish, "Translate")
+
+  DIAG_ARTIFACT("llvm_ir_unopt.ll", printRaw(module))
+  DIAG(eventStart, "Optimize LLVM")
 
+  optimize();
+
+  DIAG(eventFinish, "Optimize LLVM")
+  DIAG_ARTIFACT("llvm_ir_opt.ll", printRaw(module))
+}
+
+void Backend::LLVM::ModuleCompiler::compileFragment(
+  IR::Graph &graph,
+  IR::Graph &fragment,
+  const std::string &name
+) {
   DIAG(eventStart, "Translate")
 
-  auto fragmentFunction = llvm::Function::Create(
-    fragmentType,
-    llvm::Function::ExternalLinkage,
-    name,
-    module
-  );
-  fragmentFunction->addAttribute(2, llvm::Attribute::NoAlias);
+  // Every function is declared, the one being compiled is defined by giving it blocks
+  functions.clear();
+  llvm::Function *fragmentFunction = nullptr;
+  for (size_t i = 0; i < graph.functions.size(); i++) {
+    auto function = createFragment(name + "." + std::to_string(i), llvm::Function::ExternalLinkage);
+    function->addFnAttr(llvm::Attribute::NoInline);
+    if (graph.functions[i].get() == &fragment) fragmentFunction = function;
+    functions.push_back(function);
+  }
+  if (&fragment == &graph) {
+    fragmentFunction = createFragment(name, llvm::Function::ExternalLinkage);
+  }
+  assert(fragmentFunction != nullptr);
+  compileFunction(fragment, fragmentFunction);
+
+  DIAG(eventFinish, "Translate")
+}
+
+llvm::Function *Backend::LLVM::ModuleCompiler::createFragment(
+  const std::string &name,
+  llvm::GlobalValue::LinkageTypes linkage
+) {
+  auto function = llvm::Function::Create(fragmentType, linkage, name, module);
+  function->addAttribute(2, llvm::Attribute::NoAlias);
+  // Passes which query the target of a function, such as the vectorizers, see the CPU and features of the machine
+  function->addFnAttr("target-cpu", machine.getTargetCPU());
+  function->addFnAttr("target-features", machine.getTargetFeatureString());
+  return function;
+}
+
+void Backend::LLVM::ModuleCompiler::compileFunction(IR::Graph &graph, llvm::Function *fragmentFunction) {
+  graph.clearPassData();
+  pendingPhis.clear();
 
   int numBlocks = graph.blocks.size();
   for (int b = 0; b < numBlocks; b++) {
@@ -173,16 +327,6 @@ void Backend::LLVM::ModuleCompiler::compileGraph(IR::Graph &graph, const std::st
       phi->addIncoming(value, block);
     }
   }
-
-  DIAG(eventFinish, "Translate")
-
-  DIAG_ARTIFACT("llvm_ir_unopt.ll", printRaw(module))
-  DIAG(eventStart, "Optimize LLVM")
-
-  optimize();
-
-  DIAG(eventFinish, "Optimize LLVM")
-  DIAG_ARTIFACT("llvm_ir_opt.ll", printRaw(module))
 }
 
 void Backend::LLVM::ModuleCompiler::compileBlock(IR::Block &block) {
@@ -195,6 +339,16 @@ void Backend::LLVM::ModuleCompiler::compileBlock(IR::Block &block) {
   }
 }
 
+// Builds a vector of cells holding the values of a constant array
+static llvm::Constant *cellVector(llvm::Type *cellType, const std::vector<int64_t> &values) {
+  std::vector<llvm::Constant*> elements;
+  elements.reserve(values.size());
+  for (int64_t value : values) {
+    elements.push_back(llvm::ConstantInt::get(cellType, (uint64_t)value));
+  }
+  return llvm::ConstantVector::get(elements);
+}
+
 llvm::Value *Backend::LLVM::ModuleCompiler::compileInst(IR::Inst *inst) {
   switch (inst->kind) {
     case IR::I_REG:
@@ -226,6 +380,43 @@ llvm::Value *Backend::LLVM::ModuleCompiler::compileInst(IR::Inst *inst) {
         getValue(inst->inputs[0], type),
         getValue(inst->inputs[1], type)
       );
+    } case IR::I_MUL: {
+      auto type = convertType(Opt::resolveType(inst));
+      return builder.CreateMul(
+        getValue(inst->inputs[0], type),
+        getValue(inst->inputs[1], type)
+      );
+    } case IR::I_DIV:
+    case IR::I_MOD: {
+      auto type = convertType(Opt::resolveType(inst));
+      auto divisor = getValue(inst->inputs[1], type);
+      // Dividing by zero is undefined in LLVM, the IR divides by one instead
+      divisor = builder.CreateSelect(
+        builder.CreateICmpEQ(divisor, llvm::ConstantInt::get(type, 0)),
+        llvm::ConstantInt::get(type, 1),
+        divisor
+      );
+      auto dividend = getValue(inst->inputs[0], type);
+      return inst->kind == IR::I_DIV ? builder.CreateUDiv(dividend, divisor) : builder.CreateURem(dividend, divisor);
+    } case IR::I_LT: {
+      auto type = convertType(Opt::resolveType(inst));
+      return builder.CreateZExt(
+        builder.CreateICmpULT(
+          getValue(inst->inputs[0], type),
+          getValue(inst->inputs[1], type)
+        ),
+        type
+      );
+    } case IR::I_SELECT: {
+      auto type = convertType(Opt::resolveType(inst));
+      return builder.CreateSelect(
+        builder.CreateICmpNE(
+          getValue(inst->inputs[0], cellType),
+          llvm::ConstantInt::get(cellType, 0)
+        ),
+        getValue(inst->inputs[1], type),
+        getValue(inst->inputs[2], type)
+      );
     } case IR::I_GEP:
       return builder.CreateGEP(
         getValue(inst->inputs[0]),
@@ -241,11 +432,56 @@ llvm::Value *Backend::LLVM::ModuleCompiler::compileInst(IR::Inst *inst) {
         getValue(inst->inputs[1]),
         getValue(inst->inputs[0])
       );
-    case IR::I_PUTCHAR:
+    case IR::I_FILL: {
+      // Only fills whose value repeats the same byte are created, so the low byte stands for the whole cell
+      auto cellBytes = (uint64_t)config.cellWidth / 8;
+      return builder.CreateMemSet(
+        getValue(inst->inputs[0]),
+        builder.CreateTrunc(getValue(inst->inputs[1], cellType), llvm::Type::getInt8Ty(context)),
+        (uint64_t)inst->immValue * cellBytes,
+        llvm::MaybeAlign(cellBytes)
+      );
+    } case IR::I_COPY: {
+      auto cellBytes = (uint64_t)config.cellWidth / 8;
+      return builder.CreateMemCpy(
+        getValue(inst->inputs[0]),
+        llvm::MaybeAlign(cellBytes),
+        getValue(inst->inputs[1]),
+        llvm::MaybeAlign(cellBytes),
+        (uint64_t)inst->immValue * cellBytes
+      );
+    } case IR::I_VSTR:
+    case IR::I_VADD: {
+      // Cells are only aligned to their own width, vectors of them are accessed as such
+      auto align = llvm::MaybeAlign((uint64_t)config.cellWidth / 8);
+      auto vector = cellVector(cellType, inst->block->graph->constants[inst->immValue]);
+      auto address = builder.CreateBitCast(
+        getValue(inst->inputs[0]),
+        llvm::PointerType::getUnqual(vector->getType())
+      );
+      llvm::Value *value = vector;
+      if (inst->kind == IR::I_VADD) {
+        value = builder.CreateAdd(builder.CreateAlignedLoad(vector->getType(), address, align), vector);
+      }
+      return builder.CreateAlignedStore(value, address, align);
+    } case IR::I_PUTCHAR:
       return builder.CreateCall(putcharFunction, {
         builder.GetInsertBlock()->getParent()->args().begin(),
         getValue(inst->inputs[0], intType)
       });
+    case IR::I_WRITE: {
+      auto &values = inst->block->graph->constants[inst->immValue];
+      std::string data(values.begin(), values.end());
+      return builder.CreateCall(writeFunction, {
+        builder.GetInsertBlock()->getParent()->args().begin(),
+        builder.CreateGlobalStringPtr(data, "output"),
+        llvm::ConstantInt::get(sizeType, data.size())
+      });
+    } case IR::I_CALL:
+      return builder.CreateCall(functions[inst->immValue], {
+        builder.GetInsertBlock()->getParent()->args().begin(),
+        getValue(inst->inputs[0], cellPtrType)
+      });
     case IR::I_GETCHAR:
       return builder.CreateIntCast(
         builder.CreateCall(getcharFunction, {
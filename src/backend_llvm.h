@@ -2,11 +2,11 @@
 
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/LegacyPassManager.h>
 
 #include "ir.h"
 #include "diagnostics.h"
 #include "bfvm.h"
+#include "report.h"
 
 namespace Backend::LLVM {
   // Converts various printable llvm types to a std::string
@@ -25,8 +25,6 @@ namespace Backend::LLVM {
     llvm::LLVMContext &context;
     llvm::IRBuilder<> builder;
     llvm::Module &module;
-    llvm::legacy::PassManager passManager;
-    llvm::legacy::FunctionPassManager functionPassManager;
 
     llvm::Type *intType;
     llvm::Type *voidType;
@@ -41,12 +39,21 @@ namespace Backend::LLVM {
     llvm::FunctionType *getcharType;
     llvm::Function *getcharFunction;
 
+    llvm::FunctionType *writeType;
+    llvm::Function *writeFunction;
+
     llvm::FunctionType *fragmentType;
 
+    // Function of each outlined graph of the program being compiled
+    std::vector<llvm::Function*> functions;
+
     std::vector<IR::Inst*> pendingPhis;
 
     llvm::Value *regValues[IR::NUM_REGS];
 
+    // Receives LLVM pass timings when non-null
+    Report::Compile *report = nullptr;
+
     DIAG_DECL()
 
     explicit ModuleCompiler(
@@ -61,11 +68,37 @@ namespace Backend::LLVM {
     // Gets the llvm type of an IR type
     llvm::Type *convertType(IR::TypeId typeId);
 
-    // Compiles this IR graph into the current llvm module
+    // Compiles this IR graph and its functions into the current llvm module
     void compileGraph(IR::Graph &graph, const std::string &name);
 
+    // Compiles only [fragment], the program [graph] itself or one of its functions, into the current llvm module
+    // without optimizing it. The other functions are declared external, so that each fragment can be compiled in a
+    // module of its own and linked with the others
+    void compileFragment(IR::Graph &graph, IR::Graph &fragment, const std::string &name);
+
+    // Creates a function taking the context and the pointer and returning the pointer, like every compiled graph,
+    // tuned for the CPU of the machine
+    llvm::Function *createFragment(const std::string &name, llvm::GlobalValue::LinkageTypes linkage);
+
+    // Compiles the blocks of a single graph into [fragmentFunction]
+    void compileFunction(IR::Graph &graph, llvm::Function *fragmentFunction);
+
     void compileBlock(IR::Block &block);
     llvm::Value *compileInst(IR::Inst *inst);
     llvm::Value *getValue(IR::Inst *inst, llvm::Type *type = nullptr);
   };
+
+  // Whether [level] names an LLVM optimization pipeline: 0 to 3 for the default pipelines of each level, or lean for
+  // a short one tuned to the code the IR lowers to
+  bool isOptLevel(const std::string &level);
+
+  // Verifies and optimizes a module for [machine] with the pipeline named by config.optLevel, adding the LLVM pass
+  // timers to [report] if non-null. Modules in different contexts can be optimized on different threads as long as
+  // none of them is timed
+  void optimizeModule(
+    llvm::Module &module,
+    llvm::TargetMachine &machine,
+    const BFVM::Config &config,
+    Report::Compile *report = nullptr
+  );
 }
\ No newline at end of file
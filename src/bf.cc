@@ -1,6 +1,7 @@
 #include <map>
 #include <cassert>
 #include "bf.h"
+#include "idioms.h"
 
 using namespace BF;
 
@@ -26,6 +27,14 @@ struct LoopInfo {
   bool pure = true;
 };
 
+// An idiom whose instructions are still being parsed
+struct OpenIdiom {
+  size_t span;
+  size_t start;
+  // Position in the source past the idiom
+  size_t end;
+};
+
 struct Parser {
   Program &program;
   const std::string &str;
@@ -36,6 +45,7 @@ struct Parser {
   size_t loopIndex = 1;
 
   std::vector<LoopInfo> loopCache;
+  std::vector<OpenIdiom> openIdioms;
 
   size_t scan() {
     size_t loop = loopCache.size();
@@ -112,13 +122,30 @@ struct Parser {
     }
   }
 
+  // Marks the instructions starting at pos as an idiom if they match one of the library, patterns end with a loop
+  // that is not a seek so parsing always stops right past them
+  void matchIdiom() {
+    size_t end;
+    size_t idiom = Idioms::match(str, pos, end);
+    if (idiom == Idioms::none) return;
+    openIdioms.push_back({program.idioms.size(), program.block.size() + 1, end});
+    program.idioms.push_back({idiom, 0});
+    program.block.push_back(I_IDIOM);
+  }
+
   void parse() {
     for (;;) {
+      while (!openIdioms.empty() && openIdioms.back().end == pos) {
+        OpenIdiom &open = openIdioms.back();
+        program.idioms[open.span].length = program.block.size() - open.start;
+        openIdioms.pop_back();
+      }
       switch (str[pos]) {
         case '+': program.block.push_back(I_ADD); break;
         case '-': program.block.push_back(I_SUB); break;
         case '[':
           if (!loopCache[loopIndex].pure) {
+            matchIdiom();
             loopIndex++;
             program.block.push_back(I_LOOP);
             break;
@@ -158,6 +185,7 @@ std::string Program::print() const {
   std::string str;
   int seekIndex = 0;
   int defIndex = 0;
+  int idiomIndex = 0;
   for (Inst inst : block) {
     switch (inst) {
       case I_ADD: str.push_back('+'); break;
@@ -174,6 +202,11 @@ std::string Program::print() const {
       case I_SEEK:
         str += printDefIndex(seeks[seekIndex++]);
         break;
+      case I_IDIOM:
+        str += '(';
+        str += Idioms::library()[idioms[idiomIndex++].idiom].name;
+        str += ')';
+        break;
     }
   }
   return str;
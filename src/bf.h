@@ -43,6 +43,15 @@ namespace BF {
     I_END,
     I_PUTCHAR,
     I_GETCHAR,
+    I_IDIOM,
+  };
+
+  // Instructions following an I_IDIOM that run a well-known algorithm, which lowering can replace by the native
+  // operation it computes
+  struct IdiomSpan {
+    // Index into Idioms::library()
+    size_t idiom = 0;
+    size_t length = 0;
   };
 
   struct Program {
@@ -50,6 +59,7 @@ namespace BF {
 
     std::vector<Def> defs;
     std::vector<DefIndex> seeks;
+    std::vector<IdiomSpan> idioms;
     std::vector<Inst> block;
 
     static Program parse(const std::string &str);
@@ -6,6 +6,7 @@
 #include "bf.h"
 #include "diagnostics.h"
 #include "lowering.h"
+#include "eval.h"
 #include "opt.h"
 #include "jit.h"
 
@@ -118,6 +119,7 @@ enum InputState {
 struct IO;
 int bfGetchar(IO *io);
 void bfPutchar(IO *context, int x);
+void bfWrite(IO *io, const char *data, size_t size);
 
 struct IO {
 #ifndef NDIAG
@@ -132,15 +134,23 @@ struct IO {
 };
 
 struct CompileContext {
-  const BFVM::Config &config;
+  const BFVM::Config &options;
+
+  // Options as planned for the program being compiled
+  BFVM::Config config;
 
 #ifndef NDIAG
   CommandLineDiag *diag = nullptr;
+  Report::Compile report;
+
+  bool isReporting() {
+    return !config.report.empty() || !config.dump.empty();
+  }
 #endif
 
   std::unique_ptr<JIT::Pipeline> jit;
 
-  explicit CompileContext(const BFVM::Config &config) : config(config) {
+  explicit CompileContext(const BFVM::Config &config) : options(config), config(config) {
 #ifndef NDIAG
     if (config.profile >= 0 || !config.dump.empty()) {
       diag = new CommandLineDiag(config);
@@ -161,25 +171,59 @@ struct CompileContext {
 #endif
   }
 
+  std::unique_ptr<IR::Graph> lower(const BF::Program &program, const Eval::Prefix &prefix) {
+    DIAG(eventStart, "Lower")
+    auto graph = Lowering::buildProgram(config, program, &prefix);
+    graph->buildDominators();
+    Opt::validate(*graph);
+    DIAG(eventFinish, "Lower")
+    return graph;
+  }
+
   std::unique_ptr<IR::Graph> buildGraph(const std::string &code) {
+    // Each program is planned afresh
+    config = options;
+
     DIAG(eventStart, "Parse")
     auto program = BF::Program::parse(code);
     DIAG(eventFinish, "Parse")
 
     DIAG_ARTIFACT("bf.txt", program.print())
 
-    DIAG(eventStart, "Lower")
-    auto graph = Lowering::buildProgram(config, program);
-    graph->buildDominators();
-    Opt::validate(*graph);
-    DIAG(eventFinish, "Lower")
+    DIAG(eventStart, "Evaluate")
+    auto prefix = Eval::run(config, program);
+    DIAG(eventFinish, "Evaluate")
+    DIAG(log,
+      "Evaluated " + std::to_string(prefix.steps) + " steps, resuming at " +
+      std::to_string(prefix.position) + "/" + std::to_string(program.block.size())
+    )
+
+    auto graph = lower(program, prefix);
 
     DIAG_ARTIFACT("ir_unopt.txt", IR::printGraph(*graph))
 
     Opt::validate(*graph);
     DIAG(eventStart, "Optimize")
-    Opt::resolveRegs(*graph);
-    Opt::fold(*graph, Opt::standardFoldRules());
+    Opt::Pipeline pipeline(config);
+    DIAG_FWD(pipeline)
+#ifndef NDIAG
+    if (isReporting()) pipeline.report = &report;
+#endif
+    pipeline.runEarly(*graph);
+    if (config.compileBudget != 0) {
+      auto plan = JIT::plan(config, program, prefix, *graph);
+      DIAG(log, plan.print(config))
+      config.optLevel = plan.optLevel;
+      config.skipExpensivePasses = plan.skipExpensivePasses;
+      if (plan.splitSize != config.splitSize) {
+        // Outlining is up to the lowering, which starts over to split the program more finely
+        config.splitSize = plan.splitSize;
+        graph->destroy();
+        graph = lower(program, prefix);
+        pipeline.runEarly(*graph);
+      }
+    }
+    pipeline.runLate(*graph);
     DIAG(eventFinish, "Optimize")
 
     DIAG_ARTIFACT("ir.txt", IR::printGraph(*graph))
@@ -195,10 +239,25 @@ struct CompileContext {
     if (!jit) {
       jit = std::make_unique<JIT::Pipeline>(config);
       DIAG_FWD(*jit)
+      DIAG(log, "Targeting " + jit->machine->getTargetCPU().str())
     }
     jit->addSymbol("bf_putchar", bfPutchar);
     jit->addSymbol("bf_getchar", bfGetchar);
-    return jit->compile(graph, name);
+    jit->addSymbol("bf_write", bfWrite);
+#ifndef NDIAG
+    if (isReporting()) jit->report = &report;
+#endif
+    auto handle = jit->compile(graph, name);
+#ifndef NDIAG
+    if (isReporting()) {
+      DIAG_ARTIFACT("report.json", report.toJson())
+      if (!config.report.empty()) {
+        std::ofstream file = Util::openFile(config.report, false);
+        file << report.toJson();
+      }
+    }
+#endif
+    return handle;
   }
 
   void run(BFVM::Handle &handle) {
@@ -293,6 +352,17 @@ void bfPutchar(IO *io, int x) {
   fputc(x, io->outputFile);
 }
 
+void bfWrite(IO *io, const char *data, size_t size) {
+#ifndef NDIAG
+  if (io->inputState == IS_READING) {
+    return;
+  } else if (io->inputState == IS_RECORDING) {
+    io->outputRecording.append(data, size);
+  }
+#endif
+  fwrite(data, 1, size, io->outputFile);
+}
+
 struct InterpreterImpl : public BFVM::Interpreter {
   CompileContext context;
 
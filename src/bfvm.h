@@ -13,10 +13,20 @@ namespace BFVM {
     uint32_t eofValue = 0;
     std::string inputFile;
     std::string outputFile;
+    uint64_t evalBudget = 1000000;
+    uint32_t splitSize = 8192;
+    unsigned compileThreads = 0;
+    bool lazy = false;
+    std::string optLevel = "2";
+    bool skipExpensivePasses = false;
+    uint64_t compileBudget = 0;
+    std::string cpu;
+    std::string cpuFeatures;
 #ifndef NDIAG
     int profile = -1;
     bool quiet = false;
     bool dontRun = false;
+    std::string report;
 #endif
   };
 
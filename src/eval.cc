@@ -0,0 +1,269 @@
+#include <unordered_map>
+
+#include "eval.h"
+
+using namespace BF;
+
+enum Status {
+  S_OK,
+  S_INPUT,
+  S_BUDGET,
+  S_FAULT,
+};
+
+// Programs spreading over more cells than this are left to the compiled code
+static const int64_t maxCells = 1 << 22;
+
+struct Evaluator {
+  const BFVM::Config &config;
+  const Program &program;
+
+  uint64_t mask;
+  int64_t minIndex;
+  int64_t maxIndex;
+
+  // Cells from tapeStart onwards, along with the commit epoch in which their old value was last journaled
+  int64_t tapeStart = 0;
+  std::vector<uint64_t> tape;
+  std::vector<uint32_t> journaled;
+  uint32_t epoch = 1;
+  std::vector<std::pair<int64_t, uint64_t>> journal;
+
+  // Index of the matching bracket of each I_LOOP and I_END, and of the def or seek of each I_DEF and I_SEEK
+  std::vector<size_t> match;
+  std::vector<size_t> operand;
+
+  std::unordered_map<DefIndex, int64_t> defs;
+
+  int64_t ptr = 0;
+  uint64_t steps = 0;
+  std::string output;
+
+  // State at the last top-level instruction boundary
+  size_t committedPos = 0;
+  int64_t committedPtr = 0;
+  size_t committedOutput = 0;
+
+  Evaluator(const BFVM::Config &config, const Program &program) :
+    config(config),
+    program(program) {
+    mask = config.cellWidth == 64 ? ~(uint64_t)0 : ((uint64_t)1 << (unsigned)config.cellWidth) - 1;
+    auto cellBytes = (size_t)config.cellWidth / 8;
+    minIndex = -(int64_t)(config.memory.sizeLeft / cellBytes);
+    maxIndex = (int64_t)(config.memory.sizeRight / cellBytes);
+  }
+
+  // Pairs up brackets, returns false if they are unbalanced
+  bool prepare() {
+    auto length = program.block.size();
+    match.resize(length);
+    operand.resize(length);
+    std::vector<size_t> stack;
+    size_t defIndex = 0;
+    size_t seekIndex = 0;
+    for (size_t i = 0; i < length; i++) {
+      switch (program.block[i]) {
+        case I_LOOP:
+          stack.push_back(i);
+          break;
+        case I_END:
+          if (stack.empty()) return false;
+          match[i] = stack.back();
+          match[stack.back()] = i;
+          stack.pop_back();
+          break;
+        case I_DEF:
+          operand[i] = defIndex++;
+          break;
+        case I_SEEK:
+          operand[i] = seekIndex++;
+          break;
+        default:
+          break;
+      }
+    }
+    return stack.empty();
+  }
+
+  bool tick() {
+    return ++steps <= config.evalBudget;
+  }
+
+  [[nodiscard]] bool inBounds(int64_t index) const {
+    return index >= minIndex && index < maxIndex;
+  }
+
+  [[nodiscard]] uint64_t read(int64_t index) const {
+    if (index < tapeStart || index >= tapeStart + (int64_t)tape.size()) return 0;
+    return tape[index - tapeStart];
+  }
+
+  bool write(int64_t index, uint64_t value) {
+    if (tape.empty()) {
+      tapeStart = index;
+      tape.resize(1);
+      journaled.resize(1);
+    } else if (index < tapeStart) {
+      auto grow = (size_t)std::max(tapeStart - index, (int64_t)tape.size());
+      if ((int64_t)(tape.size() + grow) > maxCells) return false;
+      tape.insert(tape.begin(), grow, 0);
+      journaled.insert(journaled.begin(), grow, 0);
+      tapeStart -= (int64_t)grow;
+    } else if (index >= tapeStart + (int64_t)tape.size()) {
+      auto size = std::max((size_t)(index - tapeStart + 1), tape.size() * 2);
+      if ((int64_t)size > maxCells) return false;
+      tape.resize(size);
+      journaled.resize(size);
+    }
+
+    auto i = (size_t)(index - tapeStart);
+    if (journaled[i] != epoch) {
+      journal.emplace_back(index, tape[i]);
+      journaled[i] = epoch;
+    }
+    tape[i] = value & mask;
+    return true;
+  }
+
+  void commit(size_t pos) {
+    committedPos = pos;
+    committedPtr = ptr;
+    committedOutput = output.size();
+    journal.clear();
+    epoch++;
+  }
+
+  void rollback() {
+    for (auto it = journal.rbegin(); it != journal.rend(); it++) {
+      tape[it->first - tapeStart] = it->second;
+    }
+    ptr = committedPtr;
+    output.resize(committedOutput);
+    journal.clear();
+    epoch++;
+  }
+
+  Status evalSeek(const Seek &seek, int64_t &cursor) {
+    cursor += seek.offset;
+    for (const SeekLoop &loop : seek.loops) {
+      for (;;) {
+        if (!inBounds(cursor)) return S_FAULT;
+        if (read(cursor) == 0) break;
+        if (!tick()) return S_BUDGET;
+        Status status = evalSeek(loop.seek, cursor);
+        if (status != S_OK) return status;
+      }
+      cursor += loop.offset;
+    }
+    return S_OK;
+  }
+
+  Status evalDef(const Def &def, int64_t &cursor) {
+    for (auto &sub : def.body) {
+      Status status = S_OK;
+      if (auto subDef = std::get_if<Def>(&sub)) {
+        status = evalDef(*subDef, cursor);
+      } else if (auto seek = std::get_if<Seek>(&sub)) {
+        status = evalSeek(*seek, cursor);
+      }
+      if (status != S_OK) return status;
+    }
+    defs[def.index] = cursor;
+    return S_OK;
+  }
+
+  Status run() {
+    auto length = program.block.size();
+    size_t pc = 0;
+    size_t depth = 0;
+    while (pc != length) {
+      auto inst = program.block[pc];
+      // A seek always directly follows its def and an idiom always precedes its instructions, resuming in between
+      // them would lose the def or the idiom
+      if (depth == 0 && inst != I_SEEK && (pc == 0 || program.block[pc - 1] != I_IDIOM)) commit(pc);
+      if (!tick()) return S_BUDGET;
+      if (inst != I_DEF && inst != I_SEEK && !inBounds(ptr)) return S_FAULT;
+      switch (inst) {
+        case I_ADD:
+          if (!write(ptr, read(ptr) + 1)) return S_FAULT;
+          pc++;
+          break;
+        case I_SUB:
+          if (!write(ptr, read(ptr) - 1)) return S_FAULT;
+          pc++;
+          break;
+        case I_DEF: {
+          int64_t cursor = ptr;
+          Status status = evalDef(program.defs[operand[pc]], cursor);
+          if (status != S_OK) return status;
+          pc++;
+          break;
+        } case I_SEEK:
+          ptr = defs[program.seeks[operand[pc]]];
+          pc++;
+          break;
+        case I_LOOP:
+          if (read(ptr) == 0) {
+            pc = match[pc] + 1;
+          } else {
+            depth++;
+            pc++;
+          }
+          break;
+        case I_END:
+          if (read(ptr) != 0) {
+            pc = match[pc] + 1;
+          } else {
+            depth--;
+            pc++;
+          }
+          break;
+        case I_PUTCHAR:
+          output.push_back((char)read(ptr));
+          pc++;
+          break;
+        case I_GETCHAR:
+          return S_INPUT;
+        case I_IDIOM:
+          pc++;
+          break;
+      }
+    }
+    commit(pc);
+    return S_OK;
+  }
+
+  Eval::Prefix build() {
+    Eval::Prefix prefix;
+    prefix.steps = steps;
+    prefix.position = committedPos;
+    for (size_t i = 0; i < committedPos; i++) {
+      switch (program.block[i]) {
+        case I_DEF: prefix.defIndex++; break;
+        case I_SEEK: prefix.seekIndex++; break;
+        case I_IDIOM: prefix.idiomIndex++; break;
+        default: break;
+      }
+    }
+    prefix.offset = committedPtr;
+    prefix.output = output;
+
+    size_t first = 0;
+    size_t last = tape.size();
+    while (first != last && tape[first] == 0) first++;
+    while (last != first && tape[last - 1] == 0) last--;
+    prefix.tapeStart = tapeStart + (int64_t)first;
+    prefix.tape.assign(tape.begin() + first, tape.begin() + last);
+    return prefix;
+  }
+};
+
+Eval::Prefix Eval::run(const BFVM::Config &config, const Program &program) {
+  if (config.evalBudget == 0) return {};
+  Evaluator evaluator(config, program);
+  if (!evaluator.prepare()) return {};
+  if (evaluator.run() != S_OK) {
+    evaluator.rollback();
+  }
+  return evaluator.build();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "bf.h"
+#include "bfvm.h"
+
+namespace Eval {
+  // The machine state after running the input-independent prefix of a program, from an all-zero tape
+  struct Prefix {
+    // Index into the program's block where compiled code resumes, always outside of any loop
+    size_t position = 0;
+    size_t defIndex = 0;
+    size_t seekIndex = 0;
+    size_t idiomIndex = 0;
+
+    // Pointer at the resume position, relative to the start of the tape
+    int64_t offset = 0;
+
+    // Cells from tapeStart onwards, trimmed to the non-zero span
+    int64_t tapeStart = 0;
+    std::vector<int64_t> tape;
+
+    std::string output;
+
+    uint64_t steps = 0;
+
+    [[nodiscard]] bool empty() const { return position == 0; }
+  };
+
+  // Interprets [program] until its first getchar or until config.evalBudget steps have passed, rolling back to the
+  // last top-level instruction boundary if stopped inside a loop
+  Prefix run(const BFVM::Config &config, const BF::Program &program);
+}
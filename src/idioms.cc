@@ -0,0 +1,169 @@
+#include "idioms.h"
+
+using namespace IR;
+using namespace Idioms;
+
+Cells::Cells(Builder &b, Inst *base) : b(b), base(base) {}
+
+Inst *Cells::address(int64_t offset) {
+  return offset == 0 ? base : b.pushGep(base, b.pushImm(offset, T_SIZE));
+}
+
+Inst *Cells::load(int64_t offset) {
+  return b.pushLd(address(offset));
+}
+
+void Cells::store(int64_t offset, Inst *value) {
+  b.pushStr(address(offset), value);
+}
+
+void Cells::when(Inst *cond, const std::function<void()> &body) {
+  auto taken = new Block(&b.graph);
+  auto next = new Block(&b.graph);
+  b.pushIf(cond, taken, next);
+  b.setBefore(taken);
+  body();
+  b.pushGoto(next);
+  b.setBefore(next);
+}
+
+// Non-zero if the divisor at [offset] is at least two, the algorithms below never reach zero with a divisor of one
+static Inst *divisorAboveOne(Cells &c, int64_t offset) {
+  Inst *divisor = c.load(offset);
+  return c.b.pushSelect(divisor, c.b.pushSub(divisor, c.b.pushImm(1)), c.b.pushImm(0));
+}
+
+static std::vector<Idiom> buildLibrary() {
+  std::vector<Idiom> idioms;
+
+  // Prints the cell at the pointer as a decimal number using the two divisions below, once the cell two to the right
+  // has been set to ten. The number is moved one cell to the right and back, leaving the pointer there
+  idioms.push_back({
+    "print number",
+    "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>[-]>>>++++++++++<[->-[>+>>]>[+[-<+>]>+>>]<<<<<]>[-]>>"
+    "[>++++++[-<++++++++>]<.<<+>+>[-]]<[<[->-<]++++++[->++++++++<]>.[-]]<<++++++[-<++++++++>]<.[-]<<[-<+>]",
+    {{1, 0}, {2, 10}, {3, 0}, {4, 0}, {5, 0}, {6, 0}, {7, 0}, {8, 0}, {9, 0}},
+    nullptr,
+    [](Cells &c) -> Inst* {
+      Builder &b = c.b;
+      Inst *value = c.load(0);
+      Inst *hundreds = b.pushDiv(value, b.pushImm(100));
+      Inst *tens = b.pushMod(b.pushDiv(value, b.pushImm(10)), b.pushImm(10));
+      Inst *ones = b.pushMod(value, b.pushImm(10));
+      c.when(hundreds, [&]() {
+        b.pushPutchar(b.pushAdd(hundreds, b.pushImm('0')));
+      });
+      c.when(b.pushSelect(hundreds, b.pushImm(1), tens), [&]() {
+        b.pushPutchar(b.pushAdd(tens, b.pushImm('0')));
+      });
+      b.pushPutchar(b.pushAdd(ones, b.pushImm('0')));
+      // Every cell but the number is left cleared, including the ten
+      c.store(2, b.pushImm(0));
+      return c.address(1);
+    },
+  });
+
+  // n m d 0 q 0 0 -> 0 m+n d-n%d n%d q+n/d
+  idioms.push_back({
+    "divmod",
+    "[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]",
+    {{3, 0}, {5, 0}, {6, 0}},
+    [](Cells &c) { return divisorAboveOne(c, 2); },
+    [](Cells &c) -> Inst* {
+      Builder &b = c.b;
+      Inst *dividend = c.load(0);
+      Inst *divisor = c.load(2);
+      Inst *remainder = b.pushMod(dividend, divisor);
+      c.store(0, b.pushImm(0));
+      c.store(1, b.pushAdd(c.load(1), dividend));
+      c.store(2, b.pushSub(divisor, remainder));
+      c.store(3, remainder);
+      c.store(4, b.pushAdd(c.load(4), b.pushDiv(dividend, divisor)));
+      return c.base;
+    },
+  });
+
+  // n d 0 q 0 0 -> 0 d-n%d n%d q+n/d
+  idioms.push_back({
+    "divmod",
+    "[->-[>+>>]>[+[-<+>]>+>>]<<<<<]",
+    {{2, 0}, {4, 0}, {5, 0}},
+    [](Cells &c) { return divisorAboveOne(c, 1); },
+    [](Cells &c) -> Inst* {
+      Builder &b = c.b;
+      Inst *dividend = c.load(0);
+      Inst *divisor = c.load(1);
+      Inst *remainder = b.pushMod(dividend, divisor);
+      c.store(0, b.pushImm(0));
+      c.store(1, b.pushSub(divisor, remainder));
+      c.store(2, remainder);
+      c.store(3, b.pushAdd(c.load(3), b.pushDiv(dividend, divisor)));
+      return c.base;
+    },
+  });
+
+  // Decrements a and b until one of them runs out, a b -> a-b 0 with the pointer one to the left if b is in 1..a,
+  // 0 b-a otherwise
+  idioms.push_back({
+    "compare",
+    "[->-[>]<<]",
+    {{-1, 0}, {2, 0}},
+    nullptr,
+    [](Cells &c) -> Inst* {
+      Builder &b = c.b;
+      Inst *left = c.load(0);
+      Inst *right = c.load(1);
+      // A right operand of zero wraps around before it runs out
+      Inst *below = b.pushLt(b.pushSub(right, b.pushImm(1)), left);
+      c.store(0, b.pushSelect(below, b.pushSub(left, right), b.pushImm(0)));
+      c.store(1, b.pushSelect(below, b.pushImm(0), b.pushSub(right, left)));
+      return b.pushGep(c.base, b.pushSelect(below, b.pushImm(-1, T_SIZE), b.pushImm(0, T_SIZE)));
+    },
+  });
+
+  return idioms;
+}
+
+const std::vector<Idiom> &Idioms::library() {
+  static const std::vector<Idiom> idioms = buildLibrary();
+  return idioms;
+}
+
+static bool isCommand(char c) {
+  switch (c) {
+    case '+':
+    case '-':
+    case '<':
+    case '>':
+    case '[':
+    case ']':
+    case '.':
+    case ',':
+      return true;
+    default:
+      return false;
+  }
+}
+
+size_t Idioms::match(const std::string &str, size_t pos, size_t &end) {
+  auto &idioms = library();
+  for (size_t i = 0; i < idioms.size(); i++) {
+    const char *pattern = idioms[i].pattern;
+    size_t at = pos;
+    while (*pattern != 0 && at < str.size()) {
+      if (!isCommand(str[at])) {
+        at++;
+      } else if (str[at] == *pattern) {
+        at++;
+        pattern++;
+      } else {
+        break;
+      }
+    }
+    if (*pattern == 0) {
+      end = at;
+      return i;
+    }
+  }
+  return none;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+
+namespace Idioms {
+  // Cells around the pointer at the start of an idiom, addressed by their offset from it
+  struct Cells {
+    Cells(IR::Builder &b, IR::Inst *base);
+
+    IR::Builder &b;
+    IR::Inst *base;
+
+    IR::Inst *address(int64_t offset);
+    IR::Inst *load(int64_t offset);
+    void store(int64_t offset, IR::Inst *value);
+
+    // Runs what [body] pushes only if [cond] is non-zero at the cell width
+    void when(IR::Inst *cond, const std::function<void()> &body);
+  };
+
+  // A well-known brainfuck algorithm that computes a single native operation
+  struct Idiom {
+    const char *name;
+
+    // Source of the algorithm, which starts and ends with a loop that is not a pure seek
+    const char *pattern;
+
+    // Offsets of the cells the algorithm relies on holding a given value, along with that value
+    std::vector<std::pair<int64_t, int64_t>> scratch;
+
+    // Pushes a value that is non-zero if the operands are in the range the algorithm handles, null if it handles any
+    IR::Inst *(*accepts)(Cells &cells);
+
+    // Pushes the native operation, returning the pointer after it
+    IR::Inst *(*build)(Cells &cells);
+  };
+
+  static const size_t none = SIZE_MAX;
+
+  const std::vector<Idiom> &library();
+
+  // Finds the first idiom of the library whose pattern [str] starts with at [pos], ignoring comments in between,
+  // and sets [end] to the position past it, returns none if there is no such idiom
+  size_t match(const std::string &str, size_t pos, size_t &end);
+}
@@ -270,6 +270,36 @@ void Block::addSuccessor(Block *successor) {
   successor->predecessors.push_back(this);
 }
 
+void Block::removeSuccessor(Block *successor) {
+  auto succIter = std::find(successors.begin(), successors.end(), successor);
+  assert(succIter != successors.end());
+  successors.erase(succIter);
+
+  auto &v = successor->predecessors;
+  auto predIter = std::find(v.begin(), v.end(), this);
+  assert(predIter != v.end());
+  size_t index = predIter - v.begin();
+  v.erase(predIter);
+
+  for (Inst *inst = successor->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+    inst->inputs[index]->removeOutput(inst);
+    inst->inputs.erase(inst->inputs.begin() + (ptrdiff_t)index);
+  }
+}
+
+void Block::jumpTo(Block *successor) {
+  assert(!open);
+  assert(std::find(successors.begin(), successors.end(), successor) != successors.end());
+  while (successors.size() > 1) {
+    removeSuccessor(successors[0] == successor ? successors[1] : successors[0]);
+  }
+
+  open = true;
+  last->destroy();
+  insertBefore(new Inst(this, I_GOTO), nullptr);
+  open = false;
+}
+
 std::string Block::getLabel() const {
   return std::string("l") + std::to_string(id);
 }
@@ -469,9 +499,61 @@ void Graph::destroy() {
   }
   blocks.clear();
 
+  for (auto &function : functions) {
+    function->destroy();
+  }
+
   destroyed = true;
 }
 
+void Graph::removeOrphans() {
+  auto orphans = std::stable_partition(
+    blocks.begin(),
+    blocks.end(),
+    [](Block *block) { return !block->orphan; }
+  );
+  for (auto it = orphans; it != blocks.end(); it++) {
+    (*it)->graph = nullptr;
+    delete *it;
+  }
+  blocks.erase(orphans, blocks.end());
+  orphanCount = 0;
+}
+
+void Graph::renumberBlocks() {
+  std::vector<int> ids;
+  for (Block *block : blocks) {
+    ids.push_back(block->id);
+  }
+  std::sort(ids.begin(), ids.end());
+
+  std::vector<Block*> order;
+  std::unordered_set<Block*> visited = {blocks[0]};
+  std::vector<std::pair<Block*, size_t>> stack = {{blocks[0], 0}};
+  while (!stack.empty()) {
+    Block *block = stack.back().first;
+    size_t next = stack.back().second++;
+    if (next < block->successors.size()) {
+      Block *successor = block->successors[next];
+      if (visited.insert(successor).second) stack.emplace_back(successor, 0);
+    } else {
+      order.push_back(block);
+      stack.pop_back();
+    }
+  }
+  std::reverse(order.begin(), order.end());
+
+  // Unreachable blocks keep their relative order at the end
+  for (Block *block : blocks) {
+    if (!visited.contains(block)) order.push_back(block);
+  }
+
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i]->id = ids[i];
+  }
+  blocks = std::move(order);
+}
+
 void Graph::clearPassData() {
   for (Block *block : blocks) {
     block->passData = nullptr;
@@ -481,6 +563,11 @@ void Graph::clearPassData() {
 
 Graph::Graph(const BFVM::Config &config) : config(config) {}
 
+size_t Graph::addConstant(std::vector<int64_t> values) {
+  constants.push_back(std::move(values));
+  return constants.size() - 1;
+}
+
 void Graph::clearDominators() {
   builtDominators = false;
 }
@@ -524,6 +611,42 @@ Inst *Builder::pushImm(int64_t imm, TypeId typeId) {
   return newInst;
 }
 
+Inst *Builder::pushWrite(size_t constant) {
+  auto newInst = push(I_WRITE);
+  newInst->immValue = (int64_t)constant;
+  return newInst;
+}
+
+Inst *Builder::pushCall(Inst *x, size_t function) {
+  auto newInst = pushUnary(I_CALL, x);
+  newInst->immValue = (int64_t)function;
+  return newInst;
+}
+
+Inst *Builder::pushFill(Inst *address, Inst *value, int64_t count) {
+  auto newInst = pushBinary(I_FILL, address, value);
+  newInst->immValue = count;
+  return newInst;
+}
+
+Inst *Builder::pushCopy(Inst *to, Inst *from, int64_t count) {
+  auto newInst = pushBinary(I_COPY, to, from);
+  newInst->immValue = count;
+  return newInst;
+}
+
+Inst *Builder::pushVStr(Inst *address, size_t constant) {
+  auto newInst = pushUnary(I_VSTR, address);
+  newInst->immValue = (int64_t)constant;
+  return newInst;
+}
+
+Inst *Builder::pushVAdd(Inst *address, size_t constant) {
+  auto newInst = pushUnary(I_VADD, address);
+  newInst->immValue = (int64_t)constant;
+  return newInst;
+}
+
 Inst *Builder::pushUnary(InstKind kind, Inst *x) {
   std::vector<Inst*> inputs = {x};
   return push(kind, &inputs);
@@ -534,6 +657,11 @@ Inst *Builder::pushBinary(InstKind kind, Inst *x, Inst *y) {
   return push(kind, &inputs);
 }
 
+Inst *Builder::pushSelect(Inst *cond, Inst *x, Inst *y) {
+  std::vector<Inst*> inputs = {cond, x, y};
+  return push(I_SELECT, &inputs);
+}
+
 Inst *Builder::pushIf(
   Inst *cond,
   Block *whenTrue,
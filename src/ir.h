@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <set>
 #include <cassert>
@@ -22,19 +23,32 @@ namespace IR {
     I_IMM,
     I_ADD,
     I_SUB,
+    I_MUL,
+    I_DIV,
+    I_MOD,
+    I_LT,
     I_GEP,
+    I_SELECT,
     I_LD,
     I_STR,
+    I_FILL,
+    I_COPY,
+    I_VSTR,
+    I_VADD,
     I_REG,
     I_SETREG,
     I_GETCHAR,
     I_PUTCHAR,
+    I_WRITE,
+    I_CALL,
     I_PHI,
     I_IF,
     I_GOTO,
     I_RET,
   };
 
+  static const size_t NUM_INST_KINDS = I_RET + 1;
+
   typedef uint16_t TypeId;
 
   enum BuiltinTypeId : TypeId {
@@ -93,7 +107,12 @@ namespace IR {
       case I_IMM:
       case I_ADD:
       case I_SUB:
+      case I_MUL:
+      case I_DIV:
+      case I_MOD:
+      case I_LT:
       case I_GEP:
+      case I_SELECT:
       case I_LD:
       case I_REG:
       case I_PHI:
@@ -114,6 +133,45 @@ namespace IR {
     }
   }
 
+  // Whether or not this instruction kind can modify tape memory
+  static bool instMayStore(InstKind kind) {
+    switch (kind) {
+      case I_STR:
+        return true;
+      case I_SETREG:
+      case I_GETCHAR:
+      case I_PUTCHAR:
+      case I_WRITE:
+      case I_IF:
+      case I_GOTO:
+      case I_RET:
+        return false;
+      default:
+        return !instIsPure(kind);
+    }
+  }
+
+  // Whether or not this instruction kind can observe tape memory
+  static bool instMayLoad(InstKind kind) {
+    switch (kind) {
+      case I_LD:
+      case I_RET:
+        return true;
+      case I_STR:
+      case I_FILL:
+      case I_VSTR:
+      case I_SETREG:
+      case I_GETCHAR:
+      case I_PUTCHAR:
+      case I_WRITE:
+      case I_IF:
+      case I_GOTO:
+        return false;
+      default:
+        return !instIsPure(kind);
+    }
+  }
+
   struct Block;
   struct Graph;
 
@@ -247,6 +305,12 @@ namespace IR {
     void removeDominator();
     void addSuccessor(Block *successor);
 
+    // Removes the edge to [successor] along with the matching input of each of its phis
+    void removeSuccessor(Block *successor);
+
+    // Replaces the terminator with a goto to [successor], removing every other outgoing edge
+    void jumpTo(Block *successor);
+
     void assignCommonDominator(Block *predecessor);
 
     // Whether this block can ever reach the given block
@@ -272,6 +336,15 @@ namespace IR {
 
     std::vector<Block*> blocks;
 
+    // Constant arrays referenced by the immValue of instructions like I_WRITE and I_VSTR
+    std::vector<std::vector<int64_t>> constants;
+
+    // Loops lowered once and called by I_CALL wherever they occur, in the program or in one another
+    std::vector<std::unique_ptr<Graph>> functions;
+
+    // Program this graph is one of the functions of, null for the program itself
+    Graph *owner = nullptr;
+
     int orphanCount = 0;
 
     bool destroyed = false;
@@ -280,12 +353,24 @@ namespace IR {
 
     explicit Graph(const BFVM::Config &config);
 
+    // Graph holding the functions that calls of this graph refer to
+    Graph &root() { return owner == nullptr ? *this : *owner; }
+
     void clearPassData();
 
+    size_t addConstant(std::vector<int64_t> values);
+
     void buildDominators();
 
     void clearDominators();
 
+    // Frees orphaned blocks and removes them from blocks
+    void removeOrphans();
+
+    // Orders blocks in reverse postorder and reassigns their ids, so every edge which is not a back edge points to a
+    // higher id again after edges have been rearranged
+    void renumberBlocks();
+
     void destroy();
   };
 
@@ -314,13 +399,33 @@ namespace IR {
     Inst *pushImm(int64_t imm, TypeId typeId = T_INVALID);
     Inst *pushAdd(Inst *x, Inst *y) { return pushBinary(I_ADD, x, y); }
     Inst *pushSub(Inst *x, Inst *y) { return pushBinary(I_SUB, x, y); }
+    Inst *pushMul(Inst *x, Inst *y) { return pushBinary(I_MUL, x, y); }
+    // Unsigned division and remainder, a divisor of zero divides by one instead so that neither can trap
+    Inst *pushDiv(Inst *x, Inst *y) { return pushBinary(I_DIV, x, y); }
+    Inst *pushMod(Inst *x, Inst *y) { return pushBinary(I_MOD, x, y); }
+    // Unsigned comparison, one if [x] is below [y] and zero otherwise
+    Inst *pushLt(Inst *x, Inst *y) { return pushBinary(I_LT, x, y); }
     Inst *pushGep(Inst *x, Inst *y) { return pushBinary(I_GEP, x, y); }
+    // [cond] is compared to zero at the cell width, like the condition of an I_IF
+    Inst *pushSelect(Inst *cond, Inst *x, Inst *y);
     Inst *pushLd(Inst *x) { return pushUnary(I_LD, x); }
     Inst *pushStr(Inst *x, Inst *y) { return pushBinary(I_STR, x, y); }
+    // Stores [value] to [count] consecutive cells starting at [address]
+    Inst *pushFill(Inst *address, Inst *value, int64_t count);
+    // Copies [count] consecutive cells starting at [from] to the same number of cells starting at [to], the two
+    // ranges must not overlap
+    Inst *pushCopy(Inst *to, Inst *from, int64_t count);
+    // Stores the values of a constant array to consecutive cells starting at [address]
+    Inst *pushVStr(Inst *address, size_t constant);
+    // Adds the values of a constant array to consecutive cells starting at [address]
+    Inst *pushVAdd(Inst *address, size_t constant);
     Inst *pushReg(RegKind reg);
     Inst *pushSetReg(RegKind reg, Inst *x);
     Inst *pushGetchar() { return push(I_GETCHAR); }
     Inst *pushPutchar(Inst *x) { return pushUnary(I_PUTCHAR, x); }
+    Inst *pushWrite(size_t constant);
+    // Calls function [function] of the root graph on the pointer [x], returning the pointer it leaves
+    Inst *pushCall(Inst *x, size_t function);
     Inst *pushPhi(const std::vector<Inst*> *inputs = nullptr) { return push(I_PHI, inputs); }
 
     Inst *pushLdPtr() { return pushLd(pushReg(R_PTR)); }
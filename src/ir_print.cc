@@ -17,7 +17,8 @@ bool impureBetween(Inst *from, Inst *to) {
 }
 
 bool validRange(Inst &inst, Inst *from, Inst *&upper) {
-  if (inst.inputs.empty()) {
+  // The inputs of a phi are evaluated on the edges into its block, and may loop back to it in a rotated loop
+  if (inst.inputs.empty() || inst.kind == I_PHI) {
     if (!instIsPure(inst.kind)) {
       upper = &inst;
     }
@@ -94,7 +95,18 @@ static Precedence instPrecedence(InstKind kind) {
       return {2, 3};
     case I_SETREG:
     case I_STR:
+    case I_FILL:
+    case I_COPY:
+    case I_VSTR:
+    case I_VADD:
+    case I_SELECT:
       return {1, 1};
+    case I_LT:
+      return {2, 1};
+    case I_MUL:
+    case I_DIV:
+    case I_MOD:
+      return {defaultPrecedence, defaultPrecedence};
     case I_LD:
     case I_RET:
       return {0, defaultPrecedence};
@@ -131,6 +143,10 @@ std::string IR::printGraph(Graph &graph) {
     }
     str += printBlock(*block);
   }
+  for (size_t i = 0; i < graph.functions.size(); i++) {
+    str += "\n\nf" + std::to_string(i) + ":\n\n";
+    str += printGraph(*graph.functions[i]);
+  }
   return str;
 }
 
@@ -160,6 +176,47 @@ std::string IR::printBlock(Block &block) {
   return str;
 }
 
+// Prints a constant array as a quoted string, truncating long ones
+static std::string printConstantString(const std::vector<int64_t> &values) {
+  static const size_t maxLength = 64;
+  std::string str = "\"";
+  for (size_t i = 0; i < values.size() && i < maxLength; i++) {
+    auto c = (unsigned char)values[i];
+    switch (c) {
+      case '\n': str += "\\n"; break;
+      case '"': str += "\\\""; break;
+      case '\\': str += "\\\\"; break;
+      default:
+        if (c < ' ' || c > '~') {
+          static const char *digits = "0123456789abcdef";
+          str += "\\x";
+          str += digits[c >> 4u];
+          str += digits[c & 15u];
+        } else {
+          str += (char)c;
+        }
+        break;
+    }
+  }
+  str += '"';
+  if (values.size() > maxLength) {
+    str += " ... (" + std::to_string(values.size()) + " bytes)";
+  }
+  return str;
+}
+
+// Prints a constant array as a list of numbers, truncating long ones
+static std::string printConstantList(const std::vector<int64_t> &values) {
+  static const size_t maxLength = 16;
+  std::string str = "{";
+  for (size_t i = 0; i < values.size() && i < maxLength; i++) {
+    if (i != 0) str += ", ";
+    str += std::to_string(values[i]);
+  }
+  if (values.size() > maxLength) str += ", ...";
+  return str + "}";
+}
+
 static std::string printInstBody(Inst &inst) {
   Block *block = inst.block;
   auto precedence = instPrecedence(inst.kind);
@@ -169,12 +226,30 @@ static std::string printInstBody(Inst &inst) {
     case I_IMM: return std::to_string(inst.immValue);
     case I_ADD: return inputStr(ctx, 0) + " + " + inputStr({&inst, precedence.rhs}, 1);
     case I_SUB: return inputStr(ctx, 0) + " - " + inputStr({&inst, precedence.rhs}, 1);
+    case I_MUL: return inputStr(ctx, 0) + " * " + inputStr({&inst, precedence.rhs}, 1);
+    case I_DIV: return inputStr(ctx, 0) + " / " + inputStr({&inst, precedence.rhs}, 1);
+    case I_MOD: return inputStr(ctx, 0) + " % " + inputStr({&inst, precedence.rhs}, 1);
+    case I_LT: return inputStr(ctx, 0) + " < " + inputStr(ctx, 1);
+    case I_SELECT: return inputStr(ctx, 0) + " ? " + inputStr(ctx, 1) + " : " + inputStr(ctx, 2);
     case I_LD: return "[" + inputStr(ctx, 0) + "]";
     case I_STR: return "[" + inputStr(ctx, 0) + "] <- " + inputStr(ctx, 1);
+    case I_FILL:
+      return "[" + inputStr(ctx, 0) + "] x" + std::to_string(inst.immValue) + " <- " + inputStr(ctx, 1);
+    case I_COPY:
+      return "[" + inputStr(ctx, 0) + "] x" + std::to_string(inst.immValue) + " <- [" + inputStr(ctx, 1) + "]";
+    case I_VSTR: {
+      auto &values = block->graph->constants[inst.immValue];
+      return "[" + inputStr(ctx, 0) + "] x" + std::to_string(values.size()) + " <- " + printConstantList(values);
+    } case I_VADD: {
+      auto &values = block->graph->constants[inst.immValue];
+      return "[" + inputStr(ctx, 0) + "] x" + std::to_string(values.size()) + " += " + printConstantList(values);
+    }
     case I_REG: return regNames[inst.immReg];
     case I_SETREG: return std::string(regNames[inst.immReg]) + " <- " + inputStr(ctx, 0);
     case I_GETCHAR: return "getchar";
     case I_PUTCHAR: return "putchar " + inputStr(ctx, 0);
+    case I_WRITE: return "write " + printConstantString(block->graph->constants[inst.immValue]);
+    case I_CALL: return "call f" + std::to_string(inst.immValue) + " " + inputStr(ctx, 0);
     case I_PHI: {
       std::string str = "phi ";
       for (int i = 0; i < inst.inputs.size(); i++) {
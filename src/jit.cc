@@ -1,4 +1,16 @@
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <thread>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/MC/MCSubtargetInfo.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/Host.h>
+
 #include "jit.h"
+#include "lowering.h"
 
 using std::unique_ptr;
 
@@ -8,49 +20,205 @@ void JIT::init() {
   LLVMInitializeNativeAsmParser();
 }
 
+// Cost in nanoseconds of translating, optimizing and emitting a module with an LLVM pipeline: a fixed cost for each
+// module, a cost for each of its instructions and another for each loop around each of them, as every loop pass of
+// LLVM goes through the whole body of every loop
+struct LevelCost {
+  const char *level;
+  double moduleCost;
+  double instCost;
+  double nestCost;
+};
+
+// Costs of each pipeline in nanoseconds, most effort first. These were fitted by stackvm-scale --calibrate on a build
+// of this tree ported to the ORC API of LLVM 14, not on the LLVM 11 it targets, and are only a starting point until
+// they are fitted again on an LLVM 11 build. There the estimates were within 0.2x to 3.5x of the time taken over the
+// generated shapes
+static const LevelCost levelCosts[] = {
+  {"3", 43e6, 5322, 1709},
+  {"2", 24e6, 6915, 1935},
+  {"1", 16e6, 7648, 1779},
+  {"lean", 13e6, 4071, 4480},
+  {"0", 7.5e6, 8848, 245},
+};
+
+// Levels of the above which run the default pipelines, and thus vectorize and unroll unless told otherwise
+static const size_t defaultLevels = 3;
+
+// Share of the cost of a default pipeline left once its expensive passes are skipped, measured along with the above
+static const double cheapShare = 0.92;
+
+// Split size the plan does not go below, shorter loops gain little from being compiled apart
+static const uint32_t minSplitSize = 512;
+
+// Estimates the wall time of compiling [modules], the program first, on [threads] threads. Every module is handed to
+// the compile threads at once and each thread takes the next one as soon as it is done, which finishes no later than
+// the total work spread over the threads plus the rest of the largest module. Lazy programs only compile the program
+// module up front, the others once they are first called
+static int64_t estimateTime(
+  const std::vector<JIT::ModuleSize> &modules,
+  const LevelCost &cost,
+  double share,
+  unsigned threads,
+  bool lazy
+) {
+  double total = 0;
+  double largest = 0;
+  for (size_t i = 0; i < (lazy ? 1 : modules.size()); i++) {
+    double time = cost.moduleCost + share * (cost.instCost * modules[i].insts + cost.nestCost * modules[i].nestedInsts);
+    total += time;
+    largest = std::max(largest, time);
+  }
+  return (int64_t)(total / threads + largest * (1 - 1.0 / threads));
+}
+
+std::vector<JIT::ModuleSize> JIT::measureModules(
+  const BFVM::Config &config,
+  const BF::Program &program,
+  const Eval::Prefix *prefix,
+  IR::Graph &graph,
+  uint32_t splitSize
+) {
+  // Split sizes count HBF instructions and the cost model IR instructions, every HBF instruction is assumed to lower
+  // to as many IR instructions as it does on average in [graph]
+  size_t lowered = 0;
+  for (auto &fragment : Lowering::measureFragments(config, program, prefix)) lowered += fragment.insts;
+  double irPerInst = (double)Report::measure(graph).insts / (double)std::max<size_t>(lowered, 1);
+
+  BFVM::Config splitConfig = config;
+  splitConfig.splitSize = splitSize;
+  std::vector<ModuleSize> modules;
+  for (auto &fragment : Lowering::measureFragments(splitConfig, program, prefix)) {
+    modules.push_back({(double)fragment.insts * irPerInst, (double)fragment.nestedInsts * irPerInst});
+  }
+  return modules;
+}
+
+JIT::Plan JIT::plan(
+  const BFVM::Config &config,
+  const BF::Program &program,
+  const Eval::Prefix &prefix,
+  IR::Graph &graph
+) {
+  Plan plan;
+  plan.optLevel = config.optLevel;
+  plan.splitSize = config.splitSize;
+  plan.skipExpensivePasses = config.skipExpensivePasses;
+
+  std::vector<ModuleSize> modules = measureModules(config, program, &prefix, graph, config.splitSize);
+
+  size_t level = 0;
+  while (level + 1 < std::size(levelCosts) && plan.optLevel != levelCosts[level].level) level++;
+  unsigned threads = config.compileThreads == 0 ? std::thread::hardware_concurrency() : config.compileThreads;
+  auto estimate = [&]() {
+    double share = level < defaultLevels && plan.skipExpensivePasses ? cheapShare : 1;
+    return estimateTime(modules, levelCosts[level], share, std::max(threads, 1u), config.lazy);
+  };
+  plan.estimate = estimate();
+
+  auto budget = (int64_t)(config.compileBudget * Util::Time::millisecond);
+  if (budget == 0 || plan.estimate <= budget) return plan;
+
+  // Halve the split size until the estimate fits. Splitting too finely costs more per module than it saves, if no
+  // split size fits the one with the lowest estimate is kept
+  if (config.splitSize != 0) {
+    std::vector<ModuleSize> bestModules = modules;
+    int64_t bestEstimate = plan.estimate;
+    uint32_t splitSize = config.splitSize;
+    while (splitSize / 2 >= minSplitSize && bestEstimate > budget) {
+      splitSize /= 2;
+      modules = measureModules(config, program, &prefix, graph, splitSize);
+      int64_t splitEstimate = estimate();
+      if (splitEstimate < bestEstimate) {
+        plan.splitSize = splitSize;
+        bestModules = modules;
+        bestEstimate = splitEstimate;
+      }
+    }
+    modules = std::move(bestModules);
+    plan.estimate = bestEstimate;
+  }
+
+  // Then skip the expensive passes and step down the levels until the estimate fits, or there is nothing left to drop
+  while (plan.estimate > budget) {
+    if (level < defaultLevels && !plan.skipExpensivePasses) {
+      plan.skipExpensivePasses = true;
+    } else if (level + 1 < std::size(levelCosts)) {
+      level++;
+    } else {
+      break;
+    }
+    plan.estimate = estimate();
+  }
+  plan.optLevel = levelCosts[level].level;
+  return plan;
+}
+
+std::string JIT::Plan::print(const BFVM::Config &config) const {
+  std::string out = "Planned -O" + optLevel;
+  if (skipExpensivePasses) out += " without vectorization and unrolling";
+  out += ", split size " + std::to_string(splitSize);
+  out += ", estimated " + Util::Time::printTime(estimate);
+  if (config.compileBudget != 0) {
+    out += " for a budget of " + Util::Time::printTime((int64_t)(config.compileBudget * Util::Time::millisecond));
+  }
+  return out;
+}
+
+// Defines the symbols added to the pipeline in the library they are looked up from
+struct SymbolGenerator : llvm::orc::JITDylib::DefinitionGenerator {
+  JIT::Linker &linker;
+
+  explicit SymbolGenerator(JIT::Linker &linker) : linker(linker) {}
+
+  llvm::Error tryToGenerate(
+    llvm::orc::LookupKind kind,
+    llvm::orc::JITDylib &library,
+    llvm::orc::JITDylibLookupFlags libraryFlags,
+    const llvm::orc::SymbolLookupSet &lookupSet
+  ) override {
+    llvm::orc::SymbolMap found;
+    for (auto &[name, flags] : lookupSet) {
+      auto symbol = linker.symbols.find((*name).str());
+      if (symbol != linker.symbols.end()) {
+        found[name] = llvm::JITEvaluatedSymbol(symbol->second, llvm::JITSymbolFlags::Exported);
+      }
+    }
+    if (found.empty()) return llvm::Error::success();
+    return library.define(llvm::orc::absoluteSymbols(std::move(found)));
+  }
+};
+
+template<typename Builder>
+static auto createJIT(const BFVM::Config &config, llvm::orc::JITTargetMachineBuilder machineBuilder) {
+  return cantFail(
+    Builder()
+      .setJITTargetMachineBuilder(std::move(machineBuilder))
+      .setNumCompileThreads(config.compileThreads == 0 ? std::thread::hardware_concurrency() : config.compileThreads)
+      .create(),
+    "Could not create JIT"
+  );
+}
+
 JIT::Linker::Linker(
   const BFVM::Config &config,
-  llvm::TargetMachine &machine,
-  llvm::LLVMContext &context
+  llvm::orc::JITTargetMachineBuilder machineBuilder
 ) :
   config(config),
-  machine(machine),
-  dataLayout(machine.createDataLayout()),
-  context(context),
-  resolver(createLegacyLookupResolver(
-    session,
-    [this](llvm::StringRef nameRef) -> llvm::JITSymbol {
-      auto name = nameRef.str();
-      if (auto symbol = objectLayer.findSymbol(std::string(name), false)) {
-        return symbol;
-      } else if (auto error = symbol.takeError()) {
-        return std::move(error);
-      } if (auto address = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name)) {
-        return {address, llvm::JITSymbolFlags::Exported};
-      } else if (symbols.count(name)) {
-        return {symbols[name], llvm::JITSymbolFlags::Exported};
-      } else {
-        return {nullptr};
-      }
-    },
-    [](llvm::Error error) {
-      cantFail(std::move(error), "lookupFlags failed");
-    })
+  jit(config.lazy
+    ? unique_ptr<llvm::orc::LLJIT>(createJIT<llvm::orc::LLLazyJITBuilder>(config, std::move(machineBuilder)))
+    : createJIT<llvm::orc::LLJITBuilder>(config, std::move(machineBuilder))
   ),
-  objectLayer(
-    llvm::AcknowledgeORCv1Deprecation,
-    session,
-    [this](llvm::orc::VModuleKey key) {
-      return llvm::orc::LegacyRTDyldObjectLinkingLayer::Resources{
-        std::make_shared<llvm::SectionMemoryManager>(), resolver
-      };
-    }
-  ),
-  compileLayer(
-    llvm::AcknowledgeORCv1Deprecation,
-    objectLayer,
-    machine
-  ) {}
+  lazyJit(config.lazy ? static_cast<llvm::orc::LLLazyJIT*>(jit.get()) : nullptr),
+  dataLayout(jit->getDataLayout())
+{
+  // Symbols of the process come first, then the ones added to the pipeline
+  auto &main = jit->getMainJITDylib();
+  main.addGenerator(cantFail(
+    llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(dataLayout.getGlobalPrefix())
+  ));
+  main.addGenerator(std::make_unique<SymbolGenerator>(*this));
+}
 
 std::string JIT::Linker::mangle(const std::string &name) {
   std::string mangled;
@@ -59,77 +227,169 @@ std::string JIT::Linker::mangle(const std::string &name) {
   return stream.str();
 }
 
-llvm::orc::VModuleKey JIT::Linker::addModule(unique_ptr<llvm::Module> module) {
+llvm::orc::JITDylib &JIT::Linker::createLibrary(const std::string &name) {
+  auto &library = cantFail(jit->createJITDylib(name + "." + std::to_string(libraries++)));
+  // New libraries only search themselves, the symbols of the pipeline and the process are resolved by the main library
+  library.addToLinkOrder(jit->getMainJITDylib());
+  return library;
+}
+
+void JIT::Linker::addModule(llvm::orc::JITDylib &library, llvm::orc::ThreadSafeModule module) {
+  if (lazyJit != nullptr) {
+    // Functions of lazy modules are replaced by stubs which compile them on their first call
+    cantFail(lazyJit->addLazyIRModule(library, std::move(module)));
+  } else {
+    cantFail(jit->addIRModule(library, std::move(module)));
+  }
+}
+
+JIT::EntryFn JIT::Linker::findEntry(llvm::orc::JITDylib &library, const std::string &name, size_t functions) {
   DIAG(eventStart, "Compile")
 
-  auto key = session.allocateVModule();
-  cantFail(compileLayer.addModule(key, std::move(module)));
+  // Looking up the entry alone would only request the functions once its object refers to them, looking up every
+  // fragment at once hands them all to the compile threads together. Lazy libraries only need the stub of the entry
+  auto &session = jit->getExecutionSession();
+  auto entryName = session.intern(mangle(name));
+  llvm::orc::SymbolLookupSet lookupSet(entryName);
+  if (lazyJit == nullptr) {
+    for (size_t i = 0; i < functions; i++) {
+      lookupSet.add(session.intern(mangle(name + "." + std::to_string(i))));
+    }
+  }
+  auto symbols = cantFail(session.lookup(
+    {{&library, llvm::orc::JITDylibLookupFlags::MatchAllSymbols}},
+    lookupSet
+  ), "Could not get address");
 
   DIAG(eventFinish, "Compile")
 
-  return key;
+  return llvm::jitTargetAddressToFunction<EntryFn>(symbols[entryName].getAddress());
 }
 
-void JIT::Linker::removeModule(llvm::orc::VModuleKey key) {
-  cantFail(compileLayer.removeModule(key));
-  session.releaseVModule(key);
-}
-
-JIT::EntryFn JIT::Linker::findEntry(const std::string &name) {
-  auto symbol = compileLayer.findSymbol(mangle(name), true);
-  assert(symbol);
-  auto entryAddr = symbol.getAddress();
-  llvm::JITTargetAddress entryAddress = cantFail(std::move(entryAddr), "Could not get address");
-  return llvm::jitTargetAddressToFunction<EntryFn>(entryAddress);
+// Targets the host CPU with the features it reports unless another CPU is configured, then adds the configured features
+static llvm::orc::JITTargetMachineBuilder createMachineBuilder(const BFVM::Config &config) {
+  llvm::orc::JITTargetMachineBuilder machineBuilder(llvm::Triple(llvm::sys::getProcessTriple()));
+  if (config.cpu.empty()) {
+    machineBuilder.setCPU(llvm::sys::getHostCPUName().str());
+    llvm::StringMap<bool> hostFeatures;
+    if (llvm::sys::getHostCPUFeatures(hostFeatures)) {
+      for (auto &feature : hostFeatures) {
+        machineBuilder.getFeatures().AddFeature(feature.first(), feature.second);
+      }
+    }
+  } else {
+    machineBuilder.setCPU(config.cpu);
+  }
+  if (!config.cpuFeatures.empty()) {
+    machineBuilder.addFeatures(llvm::SubtargetFeatures(config.cpuFeatures).getFeatures());
+  }
+  return machineBuilder;
 }
 
 JIT::Pipeline::Pipeline(const BFVM::Config &config) :
   config(config),
-  machine(llvm::EngineBuilder().selectTarget()),
-  linker(config, *machine, context) {}
+  machineBuilder(createMachineBuilder(config)),
+  machine(cantFail(machineBuilder.createTargetMachine(), "Could not create target machine")),
+  linker(config, machineBuilder)
+{
+  if (!machine->getMCSubtargetInfo()->isCPUStringValid(machine->getTargetCPU())) {
+    std::cerr << "Error: Unknown CPU \"" << machine->getTargetCPU().str() << "\"" << std::endl;
+    std::exit(1);
+  }
+  if (!Backend::LLVM::isOptLevel(config.optLevel)) {
+    std::cerr << "Error: Unknown optimization level \"" << config.optLevel << "\"" << std::endl;
+    std::exit(1);
+  }
+
+  linker.jit->getIRTransformLayer().setTransform(
+    [this](llvm::orc::ThreadSafeModule module, auto &responsibility) -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+      // Target machines are not thread safe, each module is optimized for one of its own
+      auto moduleMachine = machineBuilder.createTargetMachine();
+      if (!moduleMachine) return moduleMachine.takeError();
+
+      // Lazy modules are optimized while the program runs, long after the report was written
+      bool timed = report != nullptr && !this->config.lazy;
+      std::unique_lock<std::mutex> timerLock(timerMutex, std::defer_lock);
+      if (timed) timerLock.lock();
+
+      module.withModuleDo([&](llvm::Module &fragment) {
+        Backend::LLVM::optimizeModule(fragment, **moduleMachine, this->config, timed ? report : nullptr);
+#ifndef NDIAG
+        if (diag && diag->isDumping()) {
+          std::lock_guard<std::mutex> lock(artifactMutex);
+          optimizedModules[fragment.getModuleIdentifier()] = Backend::LLVM::printRaw(fragment);
+        }
+#endif
+      });
+      return std::move(module);
+    }
+  );
+
+#ifndef NDIAG
+  linker.jit->getObjTransformLayer().setTransform(
+    [this](unique_ptr<llvm::MemoryBuffer> object) -> llvm::Expected<unique_ptr<llvm::MemoryBuffer>> {
+      if (diag && diag->isDumping()) {
+        std::lock_guard<std::mutex> lock(artifactMutex);
+        objects[object->getBufferIdentifier().str()] = object->getBuffer().str();
+      }
+      return std::move(object);
+    }
+  );
+#endif
+}
 
 std::unique_ptr<BFVM::Handle> JIT::Pipeline::compile(IR::Graph &graph, const std::string &name) {
-  auto module = std::make_unique<llvm::Module>("jit", context);
-  Backend::LLVM::ModuleCompiler moduleCompiler(config, *machine, context, *module);
-  DIAG_FWD(moduleCompiler)
-  moduleCompiler.compileGraph(graph, name);
+  auto &library = linker.createLibrary(name);
+
+  DIAG(eventStart, "Translate")
+  std::string unoptimized;
+  for (size_t i = 0; i <= graph.functions.size(); i++) {
+    IR::Graph &fragment = i == 0 ? graph : *graph.functions[i - 1];
+    auto moduleContext = std::make_unique<llvm::LLVMContext>();
+    auto module = std::make_unique<llvm::Module>(
+      i == 0 ? name : name + "." + std::to_string(i - 1),
+      *moduleContext
+    );
+    Backend::LLVM::ModuleCompiler moduleCompiler(config, *machine, *moduleContext, *module);
+    moduleCompiler.compileFragment(graph, fragment, name);
+#ifndef NDIAG
+    if (diag && diag->isDumping()) unoptimized += Backend::LLVM::printRaw(*module);
+#endif
+    linker.addModule(library, llvm::orc::ThreadSafeModule(std::move(module), std::move(moduleContext)));
+  }
+  DIAG(eventFinish, "Translate")
+  DIAG_ARTIFACT("llvm_ir_unopt.ll", unoptimized)
+
   DIAG_FWD(linker)
+  auto entry = linker.findEntry(library, name, graph.functions.size());
 
 #ifndef NDIAG
   if (diag && diag->isDumping()) {
-    llvm::legacy::PassManager pass;
-    llvm::SmallString<0> jitModuleObject;
-    llvm::raw_svector_ostream jitModuleObjectStream(jitModuleObject);
-    if (machine->addPassesToEmitFile(pass, jitModuleObjectStream, nullptr, llvm::CGFT_ObjectFile)) {
-      std::cerr << "llvm::TargetMachine.addPassesToEmitFile failed";
-      std::exit(1);
+    std::lock_guard<std::mutex> lock(artifactMutex);
+    std::string optimized;
+    for (auto &[moduleName, contents] : optimizedModules) {
+      optimized += contents;
+    }
+    diag->artifact("llvm_ir_opt.ll", optimized);
+    size_t index = 0;
+    for (auto &[objectName, contents] : objects) {
+      diag->artifact("jit_module." + std::to_string(index++) + ".o", contents);
     }
-    pass.run(*module);
-    diag->artifact("jit_module.o", (std::string)jitModuleObject);
+    optimizedModules.clear();
+    objects.clear();
   }
 #endif
 
-  auto key = linker.addModule(std::move(module));
-  return std::make_unique<Handle>(
-    key,
-    *this,
-    linker.findEntry(name)
-  );
+  return std::make_unique<Handle>(library, entry);
 }
 
 JIT::Handle::Handle(
-  llvm::orc::VModuleKey key,
-  JIT::Pipeline &pipeline,
+  llvm::orc::JITDylib &library,
   EntryFn entry
 ) :
-  key(key),
-  pipeline(pipeline),
+  library(library),
   entry(entry) {}
 
 char *JIT::Handle::operator()(void *context, char *memory) {
   return entry(context, memory);
 }
-
-JIT::Handle::~Handle() {
-  pipeline.linker.removeModule(key);
-}
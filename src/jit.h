@@ -1,17 +1,20 @@
 #pragma once
 
+#include <atomic>
+#include <map>
+#include <mutex>
+
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/IR/DataLayout.h>
 #include <llvm/ExecutionEngine/Orc/Core.h>
-#include <llvm/ExecutionEngine/Orc/Legacy.h>
-#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
-#include <llvm/ExecutionEngine/RTDyldMemoryManager.h>
-#include <llvm/ExecutionEngine/SectionMemoryManager.h>
-#include <llvm/ExecutionEngine/MCJIT.h>
-#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 #include <llvm/IR/Mangler.h>
 
 #include "ir.h"
+#include "bf.h"
+#include "eval.h"
 #include "backend_llvm.h"
 #include "diagnostics.h"
 
@@ -20,63 +23,114 @@ namespace JIT {
 
   typedef char* (*EntryFn)(void*, char*);
 
+  // Compile effort for a program, picked so that its estimated compile time fits into config.compileBudget
+  struct Plan {
+    std::string optLevel;
+    uint32_t splitSize = 0;
+    bool skipExpensivePasses = false;
+
+    // Estimated time to optimize and emit the program as planned, in nanoseconds
+    int64_t estimate = 0;
+
+    [[nodiscard]] std::string print(const BFVM::Config &config) const;
+  };
+
+  // Size of a module compiled by the JIT in IR instructions after the early passes, plain and weighted by the number of
+  // loops of the module around each of them
+  struct ModuleSize {
+    double insts = 0;
+    double nestedInsts = 0;
+  };
+
+  // Estimates the size of each module that [graph], lowered from [program] after [prefix] and through the early IR
+  // passes, is compiled into when lowered again at [splitSize], the program first. The HBF instructions lowered into
+  // each module are scaled by the IR instructions each HBF instruction lowers to on average in [graph]
+  std::vector<ModuleSize> measureModules(
+    const BFVM::Config &config,
+    const BF::Program &program,
+    const Eval::Prefix *prefix,
+    IR::Graph &graph,
+    uint32_t splitSize
+  );
+
+  // Plans the compilation of [graph], lowered from [program] after [prefix] and through the early IR passes, from the
+  // size of the modules it would be split into. Finer splitting is tried first as it costs the least code quality,
+  // then cheaper pipelines
+  Plan plan(const BFVM::Config &config, const BF::Program &program, const Eval::Prefix &prefix, IR::Graph &graph);
+
   struct Linker {
     const BFVM::Config &config;
-    llvm::TargetMachine &machine;
+    // A lazy JIT if config.lazy is set, whose modules are compiled a function at a time as the functions are called
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    llvm::orc::LLLazyJIT *lazyJit = nullptr;
     const llvm::DataLayout dataLayout;
-    llvm::LLVMContext &context;
-    llvm::orc::ExecutionSession session;
-    std::shared_ptr<llvm::orc::SymbolResolver> resolver;
-    llvm::orc::LegacyRTDyldObjectLinkingLayer objectLayer;
-    llvm::orc::LegacyIRCompileLayer<decltype(objectLayer), llvm::orc::SimpleCompiler> compileLayer;
     std::unordered_map<std::string, llvm::JITTargetAddress> symbols;
 
+    // Libraries created so far, each program is linked into one of its own so that their names never clash
+    std::atomic<size_t> libraries = 0;
+
     DIAG_DECL()
 
     Linker(
       const BFVM::Config &config,
-      llvm::TargetMachine &machine,
-      llvm::LLVMContext &context
+      llvm::orc::JITTargetMachineBuilder machineBuilder
     );
 
     std::string mangle(const std::string &name);
 
-    llvm::orc::VModuleKey addModule(std::unique_ptr<llvm::Module> module);
-    void removeModule(llvm::orc::VModuleKey key);
-    EntryFn findEntry(const std::string& name);
+    llvm::orc::JITDylib &createLibrary(const std::string &name);
+    void addModule(llvm::orc::JITDylib &library, llvm::orc::ThreadSafeModule module);
+
+    // Looks up the entry of a program along with its [functions] functions, compiling all the modules of its library
+    // at once on the compile threads of the JIT unless it is lazy, in which case it returns a stub that compiles the
+    // entry on its first call
+    EntryFn findEntry(llvm::orc::JITDylib &library, const std::string &name, size_t functions);
   };
 
-  struct Pipeline;
+  // The ORC JIT of LLVM 11 cannot unload code, the memory of a program is only released along with its pipeline
   struct Handle : public BFVM::Handle {
-    llvm::orc::VModuleKey key;
-    Pipeline &pipeline;
+    llvm::orc::JITDylib &library;
     EntryFn entry;
 
     Handle(
-      llvm::orc::VModuleKey key,
-      Pipeline &pipeline,
+      llvm::orc::JITDylib &library,
       EntryFn entry
     );
 
     char *operator()(void *context, char *memory) override;
-
-    ~Handle() override;
   };
 
   struct Pipeline {
     const BFVM::Config &config;
+
+    // Builds machines for the host CPU and its features, or for config.cpu and config.cpuFeatures when set
+    llvm::orc::JITTargetMachineBuilder machineBuilder;
     std::unique_ptr<llvm::TargetMachine> machine;
     llvm::LLVMContext context;
     Linker linker;
 
+    // Forwarded to each module compiler when non-null
+    Report::Compile *report = nullptr;
+
+    // Serializes the optimization of modules while the LLVM pass timers, which are global, are collected
+    std::mutex timerMutex;
+
+    // Optimized modules and objects emitted on the compile threads by the name of their module, kept for dumping
+    std::mutex artifactMutex;
+    std::map<std::string, std::string> optimizedModules;
+    std::map<std::string, std::string> objects;
+
     DIAG_DECL()
 
     explicit Pipeline(const BFVM::Config &config);
 
+    // Compiles the program and each of its functions as modules of their own, which the JIT optimizes and emits
+    // concurrently, or once they are first called if config.lazy is set. Programs can be compiled from several threads
+    // at once as long as no diagnostics or report are attached
     std::unique_ptr<BFVM::Handle> compile(IR::Graph &graph, const std::string &name);
 
     template<typename T> void addSymbol(const std::string& name, T *pointer) {
-      linker.symbols[name] = llvm::pointerToJITTargetAddress(pointer);
+      linker.symbols[linker.mangle(name)] = llvm::pointerToJITTargetAddress(pointer);
     }
   };
-}
\ No newline at end of file
+}
@@ -1,11 +1,49 @@
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "bf.h"
+#include "idioms.h"
 #include "ir.h"
 #include "lowering.h"
 
+// Loops shorter than this many instructions are always lowered in place, most of them are reduced to a few stores
+static const int minOutlinedLoopSize = 32;
+
+// Instructions of a loop from its I_LOOP up to and including its I_END, along with the defs, seeks and idioms
+// among them
+struct LoopSpan {
+  int end = 0;
+  int defs = 0;
+  int seeks = 0;
+  int idioms = 0;
+};
+
+// Loops occurring several times in the program or too long to compile as part of it, each lowered once into a
+// function of the program graph
+struct Outlining {
+  // Span and description of each such loop by the position of its I_LOOP
+  std::unordered_map<int, std::pair<LoopSpan, std::string>> loops;
+
+  // Function lowered for each description
+  std::unordered_map<std::string, size_t> functions;
+};
+
+// Appends the structure of [def] to [key], leaving out its index which differs between copies of a loop
+static void describeDef(std::string &key, const BF::Def &def) {
+  for (auto &sub : def.body) {
+    if (auto inner = std::get_if<BF::Def>(&sub)) {
+      key += '{';
+      describeDef(key, *inner);
+      key += '}';
+    } else if (auto seek = std::get_if<BF::Seek>(&sub)) {
+      key += seek->print();
+    }
+  }
+}
+
 struct LoopBlocks {
   explicit LoopBlocks(IR::Graph *graph) :
     cond(new IR::Block(graph)),
@@ -31,9 +69,13 @@ struct Builder {
   int pos = 0;
   int seekIndex = 0;
   int defIndex = 0;
+  int idiomIndex = 0;
 
   std::unordered_map<BF::DefIndex, IR::Inst*> defs;
 
+  // Loops to call instead of lowering them in place, null if every loop is lowered in place
+  Outlining *outlining = nullptr;
+
   void buildOffset(int offset, IR::RegKind reg = IR::R_PTR) {
     if (!offset) return;
     b.pushSetReg(
@@ -88,8 +130,236 @@ struct Builder {
     defs[def.index] = b.pushReg(IR::R_DEF);
   }
 
+  // Runs the native operation of an idiom if its scratch cells and operands are what it expects, and the algorithm
+  // itself otherwise, constant propagation removes whichever branch is not taken
+  void buildIdiom(const BF::IdiomSpan &span) {
+    const Idioms::Idiom &idiom = Idioms::library()[span.idiom];
+    Idioms::Cells cells(b, b.pushReg(IR::R_PTR));
+    IR::Inst *cond = idiom.accepts == nullptr ? b.pushImm(1) : idiom.accepts(cells);
+    for (auto &[offset, value] : idiom.scratch) {
+      IR::Inst *cell = cells.load(offset);
+      if (value != 0) cell = b.pushSub(cell, b.pushImm(value));
+      cond = b.pushSelect(cell, b.pushImm(0), cond);
+    }
+    auto native = new IR::Block(&graph);
+    auto fallback = new IR::Block(&graph);
+    b.pushIf(cond, native, fallback);
+
+    b.setBefore(fallback);
+    size_t end = pos + span.length;
+    buildBody(end);
+    assert(pos == end);
+    IR::Block *fallbackEnd = b.block;
+
+    b.setBefore(native);
+    Idioms::Cells nativeCells(b, b.pushReg(IR::R_PTR));
+    b.pushSetReg(IR::R_PTR, idiom.build(nativeCells));
+
+    // Both paths may have opened blocks of their own, which have to come first
+    auto next = new IR::Block(&graph);
+    b.pushGoto(next);
+    b.setBefore(fallbackEnd);
+    b.pushGoto(next);
+    b.setBefore(next);
+  }
+
+  // Describes the instructions of a loop such that two loops with the same description lower to the same graph,
+  // returns an empty description if the loop refers to a def outside of it
+  [[nodiscard]] std::string describeLoop(
+    int start,
+    const LoopSpan &span,
+    int firstDef,
+    int firstSeek,
+    int firstIdiom
+  ) const {
+    std::string key;
+    int def = firstDef;
+    int seek = firstSeek;
+    int idiom = firstIdiom;
+    for (int i = start; i < span.end; i++) {
+      switch (program.block[i]) {
+        case BF::I_ADD: key += '+'; break;
+        case BF::I_SUB: key += '-'; break;
+        case BF::I_LOOP: key += '['; break;
+        case BF::I_END: key += ']'; break;
+        case BF::I_PUTCHAR: key += '.'; break;
+        case BF::I_GETCHAR: key += ','; break;
+        case BF::I_DEF:
+          key += '{';
+          describeDef(key, program.defs[def++]);
+          key += '}';
+          break;
+        case BF::I_SEEK: {
+          auto target = (int)program.seeks[seek++];
+          if (target < firstDef) return "";
+          key += 's' + std::to_string(target - firstDef);
+          break;
+        } case BF::I_IDIOM: {
+          auto &idiomSpan = program.idioms[idiom++];
+          key += '(' + std::to_string(idiomSpan.idiom) + ':' + std::to_string(idiomSpan.length) + ')';
+          break;
+        }
+      }
+    }
+    return key;
+  }
+
+  // Finds the loops from the current position on which occur more than once and are long enough to be worth a call,
+  // along with the loops long enough to be split off the program even if they occur once
+  void findOutlinedLoops(Outlining &outlined) {
+    struct OpenLoop {
+      int start;
+      int defs;
+      int seeks;
+      int idioms;
+    };
+    std::vector<OpenLoop> open;
+    std::unordered_map<std::string, int> counts;
+    int defCount = defIndex;
+    int seekCount = seekIndex;
+    int idiomCount = idiomIndex;
+    for (int i = pos; i < (int)program.block.size(); i++) {
+      switch (program.block[i]) {
+        case BF::I_DEF: defCount++; break;
+        case BF::I_SEEK: seekCount++; break;
+        case BF::I_IDIOM: idiomCount++; break;
+        case BF::I_LOOP: open.push_back({i, defCount, seekCount, idiomCount}); break;
+        case BF::I_END: {
+          if (open.empty()) break;
+          OpenLoop loop = open.back();
+          open.pop_back();
+          if (i + 1 - loop.start < minOutlinedLoopSize) break;
+          LoopSpan span{i + 1, defCount - loop.defs, seekCount - loop.seeks, idiomCount - loop.idioms};
+          std::string key = describeLoop(loop.start, span, loop.defs, loop.seeks, loop.idioms);
+          if (key.empty()) break;
+          counts[key]++;
+          outlined.loops.emplace(loop.start, std::make_pair(span, std::move(key)));
+          break;
+        }
+        default:
+          break;
+      }
+    }
+    std::erase_if(outlined.loops, [&](auto &loop) {
+      bool split = config.splitSize != 0 && loop.second.first.end - loop.first >= (int)config.splitSize;
+      return counts[loop.second.second] < 2 && !split;
+    });
+  }
+
+  // Instructions from the current position on which are lowered into the program and into each function of
+  // [outlined], the first being the program. Loops are counted in the function they are outlined into rather than in
+  // the fragment calling them, and repeated loops only once
+  std::vector<Lowering::FragmentSize> measureFragments(const Outlining &outlined) {
+    // Loops around each instruction from the current position on, an I_LOOP or I_END not counting its own loop, and
+    // their running sum
+    std::vector<size_t> depthSums{0};
+    std::vector<size_t> depths;
+    size_t depth = 0;
+    for (size_t i = pos; i < program.block.size(); i++) {
+      if (program.block[i] == BF::I_END && depth > 0) depth--;
+      depths.push_back(depth);
+      depthSums.push_back(depthSums.back() + depth);
+      if (program.block[i] == BF::I_LOOP) depth++;
+    }
+    auto depthSum = [&](int start, int end) { return depthSums[end - pos] - depthSums[start - pos]; };
+
+    std::vector<int> starts;
+    for (auto &loop : outlined.loops) starts.push_back(loop.first);
+    std::sort(starts.begin(), starts.end());
+
+    // Each fragment starts out with every instruction of its span and its depth sum, to which the loops it calls are
+    // not added, nor the depth of the span itself
+    std::vector<Lowering::FragmentSize> sizes{{program.block.size() - pos, depthSums.back()}};
+    std::vector<size_t> baseDepths{0};
+    std::unordered_set<std::string> lowered;
+    // End of each outlined loop enclosing the current one with the fragment it is lowered into, -1 for the later
+    // occurrences of a repeated loop, which are calls to the function of its first one
+    std::vector<std::pair<int, int>> enclosing{{(int)program.block.size(), 0}};
+    for (int start : starts) {
+      auto &[span, key] = outlined.loops.at(start);
+      while (enclosing.back().first <= start) enclosing.pop_back();
+      int parent = enclosing.back().second;
+      if (parent < 0) continue;
+      sizes[parent].insts -= span.end - start;
+      sizes[parent].nestedInsts -= depthSum(start, span.end);
+      if (lowered.insert(key).second) {
+        sizes.push_back({(size_t)(span.end - start), depthSum(start, span.end)});
+        baseDepths.push_back(depths[start - pos]);
+        enclosing.emplace_back(span.end, (int)sizes.size() - 1);
+      } else {
+        enclosing.emplace_back(span.end, -1);
+      }
+    }
+    for (size_t i = 0; i < sizes.size(); i++) {
+      sizes[i].nestedInsts -= baseDepths[i] * sizes[i].insts;
+    }
+    return sizes;
+  }
+
+  // Lowers the loop starting at [start] into a new function of the program graph, returning its index
+  size_t buildFunction(int start, const LoopSpan &span) {
+    IR::Graph &root = graph.root();
+    auto function = std::make_unique<IR::Graph>(config);
+    function->owner = &root;
+
+    Builder builder(*function, program);
+    builder.pos = start + 1;
+    builder.defIndex = defIndex;
+    builder.seekIndex = seekIndex;
+    builder.idiomIndex = idiomIndex;
+    builder.outlining = outlining;
+    builder.b.openBlock();
+    builder.buildLoop(span.end);
+    builder.b.pushRet(builder.b.pushReg(IR::R_PTR));
+    assert(builder.pos == span.end);
+
+    // Unlike the program, whose dominators are built by the caller of the lowering, functions are complete here
+    function->buildDominators();
+    root.functions.push_back(std::move(function));
+    return root.functions.size() - 1;
+  }
+
+  // Calls the function of the loop starting at [start] if it is one to outline, lowering the function first if this
+  // is its first occurrence
+  bool buildCall(int start) {
+    auto loop = outlining->loops.find(start);
+    if (loop == outlining->loops.end()) return false;
+    auto &[span, key] = loop->second;
+
+    auto function = outlining->functions.find(key);
+    size_t index;
+    if (function == outlining->functions.end()) {
+      index = buildFunction(start, span);
+      outlining->functions.emplace(key, index);
+    } else {
+      index = function->second;
+    }
+    b.pushSetReg(IR::R_PTR, b.pushCall(b.pushReg(IR::R_PTR), index));
+
+    pos = span.end;
+    defIndex += span.defs;
+    seekIndex += span.seeks;
+    idiomIndex += span.idioms;
+    return true;
+  }
+
+  // Lowers a loop whose I_LOOP was just consumed, up to its end or up to [length]
+  void buildLoop(size_t length) {
+    auto blocks = openLoop();
+    buildBody(length);
+    if (pos < length) {
+      auto endInst = program.block[pos++];
+      assert(endInst == BF::I_END);
+    }
+    closeLoop(blocks);
+  }
+
   void buildBody() {
-    auto length = program.block.size();
+    buildBody(program.block.size());
+  }
+
+  // Builds instructions up to [length] or up to the end of the current loop
+  void buildBody(size_t length) {
     while (pos != length) {
       auto inst = program.block[pos++];
       switch (inst) {
@@ -122,16 +392,10 @@ struct Builder {
           assert(defReg != nullptr);
           b.pushSetReg(IR::R_PTR, defReg);
           break;
-        } case BF::I_LOOP: {
-          auto blocks = openLoop();
-          buildBody();
-          if (pos < program.block.size()) {
-            auto endInst = program.block[pos++];
-            assert(endInst == BF::I_END);
-          }
-          closeLoop(blocks);
+        } case BF::I_LOOP:
+          if (outlining == nullptr || !buildCall(pos - 1)) buildLoop(length);
           break;
-        } case BF::I_END:
+        case BF::I_END:
           pos--;
           return;
         case BF::I_PUTCHAR:
@@ -140,20 +404,78 @@ struct Builder {
         case BF::I_GETCHAR:
           b.pushStrPtr(b.pushGetchar());
           break;
+        case BF::I_IDIOM:
+          buildIdiom(program.idioms[idiomIndex++]);
+          break;
       }
     }
   }
 
-  void buildProgram() {
+  // Moves past the instructions evaluated by a prefix
+  void skipPrefix(const Eval::Prefix &prefix) {
+    pos = (int)prefix.position;
+    defIndex = (int)prefix.defIndex;
+    seekIndex = (int)prefix.seekIndex;
+    idiomIndex = (int)prefix.idiomIndex;
+  }
+
+  // Replays the effects of an evaluated prefix: its output, non-zero cells and final pointer
+  void buildPrefix(const Eval::Prefix &prefix) {
+    skipPrefix(prefix);
+
+    if (!prefix.output.empty()) {
+      b.pushWrite(graph.addConstant({prefix.output.begin(), prefix.output.end()}));
+    }
+
+    for (size_t i = 0; i < prefix.tape.size(); i++) {
+      if (prefix.tape[i] == 0) continue;
+      b.pushStr(
+        b.pushGep(
+          b.pushReg(IR::R_PTR),
+          b.pushImm(prefix.tapeStart + (int64_t)i, IR::T_SIZE)
+        ),
+        b.pushImm(prefix.tape[i])
+      );
+    }
+
+    buildOffset((int)prefix.offset);
+  }
+
+  void buildProgram(const Eval::Prefix *prefix) {
     b.openBlock();
+    if (prefix != nullptr && !prefix->empty()) {
+      buildPrefix(*prefix);
+    }
+    Outlining outlined;
+    findOutlinedLoops(outlined);
+    outlining = &outlined;
     buildBody();
     b.pushRet(b.pushReg(IR::R_PTR));
     assert(pos == program.block.size());
   }
 };
 
-std::unique_ptr<IR::Graph> Lowering::buildProgram(const BFVM::Config &config, const BF::Program &program) {
+std::unique_ptr<IR::Graph> Lowering::buildProgram(
+  const BFVM::Config &config,
+  const BF::Program &program,
+  const Eval::Prefix *prefix
+) {
   auto graph = std::make_unique<IR::Graph>(config);
-  Builder(*graph, program).buildProgram();
+  Builder(*graph, program).buildProgram(prefix);
   return graph;
 }
+
+std::vector<Lowering::FragmentSize> Lowering::measureFragments(
+  const BFVM::Config &config,
+  const BF::Program &program,
+  const Eval::Prefix *prefix
+) {
+  IR::Graph graph(config);
+  Builder builder(graph, program);
+  if (prefix != nullptr && !prefix->empty()) {
+    builder.skipPrefix(*prefix);
+  }
+  Outlining outlined;
+  builder.findOutlinedLoops(outlined);
+  return builder.measureFragments(outlined);
+}
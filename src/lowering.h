@@ -5,7 +5,28 @@
 
 #include "ir.h"
 #include "bf.h"
+#include "eval.h"
 
 namespace Lowering {
-  std::unique_ptr<IR::Graph> buildProgram(const BFVM::Config &config, const BF::Program &program);
+  // Lowers [program], starting from the state left by [prefix] if it is non-null
+  std::unique_ptr<IR::Graph> buildProgram(
+    const BFVM::Config &config,
+    const BF::Program &program,
+    const Eval::Prefix *prefix = nullptr
+  );
+
+  // Instructions of the program lowered into a single graph, the program graph itself or one of its functions
+  struct FragmentSize {
+    size_t insts = 0;
+    // Instructions weighted by the number of loops of the graph around them
+    size_t nestedInsts = 0;
+  };
+
+  // Counts the instructions of [program] which buildProgram lowers into the program graph itself, first, and into each
+  // of its functions. Only depends on config.splitSize and the position of [prefix]
+  std::vector<FragmentSize> measureFragments(
+    const BFVM::Config &config,
+    const BF::Program &program,
+    const Eval::Prefix *prefix = nullptr
+  );
 }
\ No newline at end of file
@@ -1,31 +1,74 @@
 #pragma once
 
+#include <array>
+#include <functional>
+
 #include "ir.h"
+#include "diagnostics.h"
+#include "report.h"
 
 namespace Opt {
   void resolveRegs(IR::Graph &graph);
+
+  // Returns the only distinct input of a phi, ignoring itself, or null if there are several
+  IR::Inst *trivialPhiInput(IR::Inst *phi);
+
+  // Replaces phis with a single distinct input by that input, along with any phis this makes trivial
+  void removeTrivialPhis(IR::Graph &graph);
+  void removeTrivialPhis(std::vector<IR::Inst*> phis);
   void validate(IR::Graph &graph);
 
+  // Instruction kind and the kinds of its first two operands, I_NOP matches any operand
   struct FoldKey {
-    FoldKey(IR::InstKind ins, IR::InstKind l = IR::I_NOP, IR::InstKind r = IR::I_NOP)
-      : value((ins << 16u) | (l << 8u) | r) {}
-    uint64_t value;
+    constexpr FoldKey(IR::InstKind ins, IR::InstKind l = IR::I_NOP, IR::InstKind r = IR::I_NOP)
+      : ins(ins), left(l), right(r) {}
+    IR::InstKind ins;
+    IR::InstKind left;
+    IR::InstKind right;
   };
 
   struct FoldState;
   typedef IR::Inst *(*FoldFn)(FoldState &state);
 
+  // Dense table of fold rules indexed by instruction kind and operand kinds, built at compile time
   struct FoldRules {
-    FoldRules() = default;
+    static const size_t maxRules = 64;
+    static const size_t maxRulesPerKey = 4;
 
-    std::unordered_map<uint64_t, FoldFn> folders = {};
+    typedef std::array<uint8_t, maxRulesPerKey> Candidates;
 
-    void add(std::initializer_list<FoldKey> keys, FoldFn fn) {
+    // Index 0 is reserved for the end of a candidate list
+    std::array<FoldFn, maxRules> folders = {};
+    size_t count = 1;
+    std::array<Candidates, IR::NUM_INST_KINDS * IR::NUM_INST_KINDS * IR::NUM_INST_KINDS> table = {};
+
+    static constexpr size_t index(IR::InstKind ins, IR::InstKind left, IR::InstKind right) {
+      return ((size_t)ins * IR::NUM_INST_KINDS + left) * IR::NUM_INST_KINDS + right;
+    }
+
+    // Rules are tried in the order they were added
+    constexpr void add(std::initializer_list<FoldKey> keys, FoldFn fn) {
+      assert(count < maxRules);
+      auto rule = (uint8_t)count++;
+      folders[rule] = fn;
       for (auto key : keys) {
-        assert(!folders.contains(key.value));
-        folders[key.value] = fn;
+        for (size_t left = 0; left < IR::NUM_INST_KINDS; left++) {
+          if (key.left != IR::I_NOP && key.left != left) continue;
+          for (size_t right = 0; right < IR::NUM_INST_KINDS; right++) {
+            if (key.right != IR::I_NOP && key.right != right) continue;
+            Candidates &candidates = table[index(key.ins, (IR::InstKind)left, (IR::InstKind)right)];
+            size_t slot = 0;
+            while (slot < maxRulesPerKey && candidates[slot] != 0) slot++;
+            assert(slot < maxRulesPerKey);
+            candidates[slot] = rule;
+          }
+        }
       }
     }
+
+    [[nodiscard]] constexpr const Candidates &lookup(IR::InstKind ins, IR::InstKind left, IR::InstKind right) const {
+      return table[index(ins, left, right)];
+    }
   };
 
   struct FoldState {
@@ -37,7 +80,10 @@ namespace Opt {
     const FoldRules &rules;
   };
 
-  FoldRules standardFoldRules();
+  const FoldRules &standardFoldRules();
+
+  // Wraps [value] to the width of [type], sign extended so that equal values always have equal immediates
+  int64_t wrapImm(int64_t value, IR::TypeId type);
 
   void fold(IR::Graph &graph, const FoldRules &rules);
 
@@ -45,6 +91,103 @@ namespace Opt {
 
   bool equal(IR::Inst *a, IR::Inst *b);
 
+  // A tape address as a base pointer plus a constant offset in cells
+  struct Location {
+    IR::Inst *base = nullptr;
+    int64_t offset = 0;
+
+    bool operator==(const Location &other) const { return base == other.base && offset == other.offset; }
+    bool operator!=(const Location &other) const { return !(*this == other); }
+  };
+
+  // Folds chains of constant I_GEPs, two locations with the same base alias only if their offsets are equal
+  Location locate(IR::Inst *address);
+
+  // Propagates constants through values and tape cells starting from the zeroed tape, removing branches and
+  // blocks that can never be taken
+  void propagateConstants(IR::Graph &graph);
+
+  // Merges straight-line chains of blocks and jumps past blocks that hold nothing but a goto
+  void simplifyCFG(IR::Graph &graph);
+
+  // Replaces loops stepping a counter cell towards zero, whose body only does arithmetic on cells at fixed offsets, by
+  // the closed form of their effect on each cell
+  void evaluateCountedLoops(IR::Graph &graph);
+
+  // Turns loops whose body always clears the cell holding their condition into forward conditionals, and bodies
+  // made of a single simple block into selects
+  void convertIfLoops(IR::Graph &graph);
+
+  // Turns loops into guarded do-while loops by copying their header, so each iteration branches once
+  void rotateLoops(IR::Graph &graph);
+
+  // A natural loop, as lowered for each brainfuck loop
+  struct Loop {
+    IR::Block *header = nullptr;
+    // Source of the only back edge, null if there are several
+    IR::Block *latch = nullptr;
+    // The only block entering the header from outside the loop, null if there is no such block
+    IR::Block *preheader = nullptr;
+    // The only block outside the loop that is branched to, null if it can be reached in several ways
+    IR::Block *exit = nullptr;
+    // Every block of the loop ordered by id, starting with the header
+    std::vector<IR::Block*> blocks;
+    std::unordered_set<IR::Block*> members;
+
+    [[nodiscard]] bool contains(IR::Block *block) const { return members.contains(block); }
+  };
+
+  // Finds every natural loop of the graph, inner loops are ordered before the loops containing them
+  std::vector<Loop> findLoops(IR::Graph &graph);
+
+  // Hoists loop invariants into preheaders and keeps cells only accessed at fixed offsets in registers
   void optimizeLoops(IR::Graph &graph);
+
+  // A header phi that advances by a constant every iteration of a loop
+  struct Induction {
+    IR::Inst *phi = nullptr;
+    // Value on entry to the loop
+    IR::Inst *start = nullptr;
+    // Advance per iteration, in cells for pointers
+    int64_t step = 0;
+    bool pointer = false;
+  };
+
+  // Finds the induction variables of a loop with a preheader and a single latch
+  std::vector<Induction> findInductions(const Loop &loop);
+
+  // Forwards cells stored by one iteration of a loop moving the pointer by a constant to the loads of later
+  // iterations that read them
+  void optimizeInductions(IR::Graph &graph);
   void optimizeCommonExpr(IR::Graph &graph);
+
+  // Forwards stored values to later loads and removes redundant or overwritten stores
+  void optimizeMemory(IR::Graph &graph);
+
+  // Replaces runs of stores to contiguous cells by a single instruction over the whole range: fills for a repeated
+  // constant, constant vectors for other constants, copies for cells read a fixed distance away and vector adds
+  // for cells updated by constants
+  void lowerBulkMemory(IR::Graph &graph);
+
+  // Runs the standard sequence of passes over a graph, timing each one individually
+  struct Pipeline {
+    const BFVM::Config &config;
+    Report::Compile *report = nullptr;
+
+    DIAG_DECL()
+
+    explicit Pipeline(const BFVM::Config &config);
+
+    void run(IR::Graph &graph);
+
+    // Resolves registers and folds, after which the size of a graph is a fair estimate of the work left compiling it
+    void runEarly(IR::Graph &graph);
+
+    // Runs the passes after the early ones
+    void runLate(IR::Graph &graph);
+
+    // Runs a single pass over the graph and each of its functions, recording its duration and effect on them in the
+    // report
+    void runPass(IR::Graph &graph, const std::string &name, const std::function<void(IR::Graph&)> &pass);
+  };
 }
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include <algorithm>
+#include <array>
+
+#include "opt.h"
+
+using namespace IR;
+using namespace Opt;
+
+// Runs of fewer stores than this are left as they are
+static const size_t minBulkCells = 4;
+
+// Destroys [inst] if it is pure and unused, along with any of its inputs this leaves unused
+static void destroyUnused(Inst *inst) {
+  if (!instIsPure(inst->kind) || !inst->outputs.empty()) return;
+  std::vector<Inst*> inputs = inst->inputs;
+  inst->destroy();
+  for (Inst *input : inputs) {
+    destroyUnused(input);
+  }
+}
+
+enum RunKind {
+  // Stores of constants
+  RUN_CONSTANT,
+  // Stores of the cells a fixed distance away
+  RUN_COPY,
+  // Stores of the cell itself plus a constant
+  RUN_UPDATE,
+  NUM_RUN_KINDS,
+};
+
+// Stores of one kind to contiguous cells of one base
+struct StoreRun {
+  RunKind kind = RUN_CONSTANT;
+  Inst *base = nullptr;
+  // Range of stored offsets, excluding hi
+  int64_t lo = 0;
+  int64_t hi = 0;
+  // Offset of the source cells relative to the stored ones for copies
+  int64_t distance = 0;
+  // Stored constant or added constant of each store
+  std::vector<int64_t> values;
+  std::vector<Inst*> stores;
+
+  [[nodiscard]] bool active() const { return !stores.empty(); }
+
+  // Whether an access of [location] may touch one of the stored cells
+  [[nodiscard]] bool covers(const Location &location) const {
+    if (!active()) return false;
+    return location.base != base || (location.offset >= lo && location.offset < hi);
+  }
+
+  // Constants of the run ordered by offset
+  [[nodiscard]] std::vector<int64_t> constants() const {
+    std::vector<int64_t> ordered(values.size());
+    for (size_t i = 0; i < stores.size(); i++) {
+      ordered[locate(stores[i]->inputs[0]).offset - lo] = values[i];
+    }
+    return ordered;
+  }
+};
+
+// What a store does to its cell, as one of the kinds of runs
+struct StoreShape {
+  RunKind kind = NUM_RUN_KINDS;
+  int64_t value = 0;
+  int64_t distance = 0;
+  // The load a copy or an update reads
+  Inst *load = nullptr;
+};
+
+struct BulkMemoryEngine {
+  Graph &graph;
+  TypeId cellType;
+
+  // Position of each instruction of the current block, as it was before any run was replaced
+  std::unordered_map<Inst*, size_t> order;
+
+  explicit BulkMemoryEngine(Graph &graph) : graph(graph), cellType(typeForWidth(graph.config.cellWidth)) {}
+
+  // Whether a store of [value] can be expressed by filling bytes, which is all a memset does
+  [[nodiscard]] bool isByteSplat(int64_t value) const {
+    auto bits = (uint64_t)value;
+    uint64_t mask = graph.config.cellWidth == 64 ? ~(uint64_t)0 : ((uint64_t)1 << graph.config.cellWidth) - 1;
+    return ((bits & 0xFFu) * 0x0101010101010101u & mask) == (bits & mask);
+  }
+
+  // Whether [inst] loads a cell of the current block
+  [[nodiscard]] bool isLocalLoad(Inst *inst) const {
+    return inst->kind == I_LD && order.contains(inst);
+  }
+
+  StoreShape shapeOf(Inst *store, const Location &location) {
+    StoreShape shape;
+    Inst *value = store->inputs[1];
+    if (value->kind == I_IMM) {
+      shape.kind = RUN_CONSTANT;
+      shape.value = wrapImm(value->immValue, cellType);
+    } else if (isLocalLoad(value)) {
+      auto source = locate(value->inputs[0]);
+      if (source.base != location.base || source.offset == location.offset) return shape;
+      shape.kind = RUN_COPY;
+      shape.distance = source.offset - location.offset;
+      shape.load = value;
+    } else if ((value->kind == I_ADD || value->kind == I_SUB) && resolveType(value) == cellType) {
+      // Folding moves constants to the right
+      Inst *load = value->inputs[0];
+      Inst *delta = value->inputs[1];
+      if (delta->kind != I_IMM || !isLocalLoad(load) || locate(load->inputs[0]) != location) return shape;
+      shape.kind = RUN_UPDATE;
+      shape.value = wrapImm(value->kind == I_ADD ? delta->immValue : -delta->immValue, cellType);
+      shape.load = load;
+    }
+    return shape;
+  }
+
+  // Adds [store] to the run if it stores the next cell at either end of it
+  static bool extend(StoreRun &run, Inst *store, const Location &location, const StoreShape &shape) {
+    if (!run.active() || run.kind != shape.kind || location.base != run.base) return false;
+    if (location.offset != run.hi && location.offset != run.lo - 1) return false;
+    if (run.kind == RUN_COPY && shape.distance != run.distance) return false;
+    run.lo = std::min(run.lo, location.offset);
+    run.hi = std::max(run.hi, location.offset + 1);
+    run.values.push_back(shape.value);
+    run.stores.push_back(store);
+    return true;
+  }
+
+  static void start(StoreRun &run, Inst *store, const Location &location, const StoreShape &shape) {
+    run.kind = shape.kind;
+    run.base = location.base;
+    run.lo = location.offset;
+    run.hi = location.offset + 1;
+    run.distance = shape.distance;
+    run.values = {shape.value};
+    run.stores = {store};
+  }
+
+  // Whether no instruction strictly between [from] and [to], other than the stores of [run], writes the cell at
+  // [location], or reads it unless [onlyStores] is set
+  static bool untouched(const StoreRun &run, Inst *from, Inst *to, const Location &location, bool onlyStores) {
+    for (Inst *inst = from->next; inst != to; inst = inst->next) {
+      if (inst->kind == I_LD || inst->kind == I_STR) {
+        if (inst->kind == I_LD && onlyStores) continue;
+        if (std::find(run.stores.begin(), run.stores.end(), inst) != run.stores.end()) continue;
+        auto accessed = locate(inst->inputs[0]);
+        if (accessed.base != location.base || accessed.offset == location.offset) return false;
+      } else if (instMayStore(inst->kind) || (!onlyStores && instMayLoad(inst->kind))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether the accesses of a run can all happen at once in place of [at]
+  [[nodiscard]] bool canMerge(const StoreRun &run, Inst *at) const {
+    for (Inst *store : run.stores) {
+      auto location = locate(store->inputs[0]);
+      Inst *value = store->inputs[1];
+      switch (run.kind) {
+        case RUN_CONSTANT:
+          // Each stored cell is now written later than before
+          if (store != at && !untouched(run, store, at, location, false)) return false;
+          break;
+        case RUN_UPDATE: {
+          // Each cell is now read and written later than before, at once
+          Inst *load = value->kind == I_LD ? value : value->inputs[0];
+          if (!untouched(run, load, at, location, false)) return false;
+          break;
+        } case RUN_COPY: {
+          // Each stored cell is now written earlier than before, and each source cell read earlier or later
+          if (store != at && !untouched(run, at, store, location, false)) return false;
+          auto source = locate(value->inputs[0]);
+          bool before = order.at(value) < order.at(at);
+          if (!untouched(run, before ? value : at, before ? at : value, source, true)) return false;
+          break;
+        } default:
+          abort();
+      }
+    }
+    return true;
+  }
+
+  // Replaces the stores of a run by a single instruction. Copies take the place of the first store, since later
+  // stores may clear the cells they read, the others the place of the last one
+  void flush(StoreRun &run) {
+    if (!run.active()) return;
+    StoreRun current = std::move(run);
+    run.stores.clear();
+    auto count = (int64_t)current.stores.size();
+    if (current.stores.size() < minBulkCells) return;
+    // Overlapping ranges would need the semantics of a memmove
+    if (current.kind == RUN_COPY && current.distance > -count && current.distance < count) return;
+
+    Inst *at = current.kind == RUN_COPY ? current.stores.front() : current.stores.back();
+    if (!canMerge(current, at)) return;
+
+    // Addresses of later cells may be computed after the first store, the base never is
+    Builder b(graph);
+    b.setBefore(at);
+    auto address = [&](int64_t offset) {
+      return offset == 0 ? current.base : b.pushGep(current.base, b.pushImm(offset, T_SIZE));
+    };
+    auto constants = current.constants();
+    switch (current.kind) {
+      case RUN_CONSTANT: {
+        bool uniform = std::all_of(constants.begin(), constants.end(), [&](int64_t value) {
+          return value == constants[0];
+        });
+        if (uniform && isByteSplat(constants[0])) {
+          b.pushFill(address(current.lo), b.pushImm(constants[0], cellType), count);
+        } else {
+          b.pushVStr(address(current.lo), graph.addConstant(std::move(constants)));
+        }
+        break;
+      } case RUN_COPY:
+        b.pushCopy(address(current.lo), address(current.lo + current.distance), count);
+        break;
+      case RUN_UPDATE:
+        b.pushVAdd(address(current.lo), graph.addConstant(std::move(constants)));
+        break;
+      default:
+        abort();
+    }
+
+    // Loads and arithmetic stay if something else uses them
+    for (Inst *store : current.stores) {
+      Inst *value = store->inputs[1];
+      store->destroy();
+      destroyUnused(value);
+    }
+  }
+
+  void run(Block *block) {
+    order.clear();
+    size_t position = 0;
+    for (Inst *inst = block->first; inst != nullptr; inst = inst->next) {
+      order[inst] = position++;
+    }
+
+    // Runs of different kinds are collected side by side, as a move clears its source cells while copying them
+    std::array<StoreRun, NUM_RUN_KINDS> runs;
+    auto flushCovering = [&](const Location &location) {
+      for (StoreRun &run : runs) {
+        if (run.covers(location)) flush(run);
+      }
+    };
+
+    Inst *inst = block->first;
+    while (inst != nullptr) {
+      Inst *following = inst->next;
+      if (inst->kind == I_STR) {
+        auto location = locate(inst->inputs[0]);
+        auto shape = shapeOf(inst, location);
+        if (shape.kind == NUM_RUN_KINDS) {
+          flushCovering(location);
+        } else if (!extend(runs[shape.kind], inst, location, shape)) {
+          flush(runs[shape.kind]);
+          flushCovering(location);
+          start(runs[shape.kind], inst, location, shape);
+        }
+      } else if (inst->kind == I_LD) {
+        flushCovering(locate(inst->inputs[0]));
+      } else if (instMayStore(inst->kind) || instMayLoad(inst->kind)) {
+        for (StoreRun &run : runs) {
+          flush(run);
+        }
+      }
+      inst = following;
+    }
+    for (StoreRun &run : runs) {
+      flush(run);
+    }
+  }
+};
+
+void Opt::lowerBulkMemory(Graph &graph) {
+  BulkMemoryEngine engine(graph);
+  for (Block *block : graph.blocks) {
+    if (block->orphan) continue;
+    engine.run(block);
+  }
+}
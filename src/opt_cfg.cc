@@ -0,0 +1,255 @@
+#include <algorithm>
+
+#include "opt.h"
+
+using namespace IR;
+using namespace Opt;
+
+// Headers with more instructions than this are not duplicated by loop rotation
+static const size_t maxRotatedHeaderSize = 16;
+
+// Whether [block] is the target of a back edge
+static bool isLoopHeader(Block *block) {
+  return std::any_of(block->predecessors.begin(), block->predecessors.end(), [&](Block *predecessor) {
+    return predecessor->id >= block->id;
+  });
+}
+
+// Appends the only successor of [block] to it if [block] is also its only predecessor
+static bool mergeSuccessor(Block *block) {
+  if (block->successors.size() != 1 || block->last->kind != I_GOTO) return false;
+  Block *successor = block->successors[0];
+  if (successor == block || successor->predecessors.size() != 1 || successor->id < block->id) return false;
+
+  // Phis of a block with a single predecessor have a single input
+  while (successor->first != nullptr && successor->first->kind == I_PHI) {
+    successor->first->rewriteWith(successor->first->inputs[0]);
+  }
+
+  block->open = true;
+  block->last->destroy();
+  successor->open = true;
+  while (successor->first != nullptr) {
+    block->moveBefore(successor->first, nullptr);
+  }
+  block->open = false;
+
+  block->successors = std::move(successor->successors);
+  successor->successors.clear();
+  successor->predecessors.clear();
+  for (Block *next : block->successors) {
+    std::replace(next->predecessors.begin(), next->predecessors.end(), successor, block);
+  }
+  successor->destroy();
+  return true;
+}
+
+// Points predecessors of a block holding nothing but a goto straight at its target, and removes the block once
+// nothing branches to it anymore
+static bool threadEmpty(Graph &graph, Block *block) {
+  if (block == graph.blocks[0] || block->first != block->last || block->last->kind != I_GOTO) return false;
+  Block *target = block->successors[0];
+  // Loop passes rely on every loop having a preheader
+  if (target == block || isLoopHeader(target)) return false;
+
+  bool changed = false;
+  size_t i = 0;
+  while (i < block->predecessors.size()) {
+    Block *predecessor = block->predecessors[i];
+    auto &successors = predecessor->successors;
+    if (
+      predecessor->id > block->id ||
+      std::count(successors.begin(), successors.end(), block) != 1 ||
+      std::find(successors.begin(), successors.end(), target) != successors.end()
+    ) {
+      i++;
+      continue;
+    }
+
+    auto &targetPredecessors = target->predecessors;
+    auto index = std::find(targetPredecessors.begin(), targetPredecessors.end(), block) - targetPredecessors.begin();
+    std::replace(successors.begin(), successors.end(), block, target);
+    block->predecessors.erase(block->predecessors.begin() + (ptrdiff_t)i);
+    targetPredecessors.push_back(predecessor);
+    for (Inst *inst = target->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+      inst->addInput(inst->inputs[index]);
+    }
+    changed = true;
+  }
+
+  if (block->predecessors.empty()) {
+    block->removeSuccessor(target);
+    block->destroy();
+  }
+  return changed;
+}
+
+void Opt::simplifyCFG(Graph &graph) {
+  bool changed = false;
+  for (Block *block : graph.blocks) {
+    if (block->orphan) continue;
+    while (mergeSuccessor(block)) {
+      changed = true;
+    }
+  }
+  for (Block *block : graph.blocks) {
+    if (block->orphan) continue;
+    changed = threadEmpty(graph, block) || changed;
+  }
+  if (!changed) return;
+
+  graph.removeOrphans();
+  graph.buildDominators();
+}
+
+static Inst *lookup(const std::unordered_map<Inst*, Inst*> &values, Inst *inst) {
+  auto value = values.find(inst);
+  return value == values.end() ? inst : value->second;
+}
+
+// Copies the instructions of a loop header to the end of [into], [values] maps header values to their value at the
+// end of that block
+static void cloneHeader(Graph &graph, Block *header, Block *into, std::unordered_map<Inst*, Inst*> &values) {
+  Builder b(graph);
+  b.setBefore(into->last);
+  for (Inst *inst = header->first; inst != header->last; inst = inst->next) {
+    if (inst->kind == I_PHI) continue;
+    std::vector<Inst*> inputs;
+    for (Inst *input : inst->inputs) {
+      inputs.push_back(lookup(values, input));
+    }
+    Inst *clone = b.push(inst->kind, &inputs);
+    clone->type = inst->type;
+    clone->immValue = inst->immValue;
+    values[inst] = clone;
+  }
+}
+
+// Turns a loop into a guarded do-while loop by copying the header into its preheader and latch, so every iteration
+// only branches once
+static bool rotateLoop(Graph &graph, const Loop &loop, std::vector<Inst*> &phis) {
+  Block *header = loop.header;
+  Block *preheader = loop.preheader;
+  Block *latch = loop.latch;
+  if (preheader == nullptr || latch == nullptr || latch == header) return false;
+  if (preheader->last->kind != I_GOTO || latch->last->kind != I_GOTO) return false;
+  if (header->last->kind != I_IF || header->predecessors.size() != 2) return false;
+
+  Block *body = nullptr;
+  Block *exit = nullptr;
+  for (Block *successor : header->successors) {
+    (loop.contains(successor) ? body : exit) = successor;
+  }
+  if (body == nullptr || exit == nullptr) return false;
+  if (body->predecessors.size() != 1 || exit->predecessors.size() != 1) return false;
+
+  size_t size = 0;
+  for (Inst *inst = header->first; inst != header->last; inst = inst->next) {
+    if (inst->kind == I_PHI) continue;
+    if (!instIsPure(inst->kind) || ++size > maxRotatedHeaderSize) return false;
+  }
+
+  auto &predecessors = header->predecessors;
+  size_t preheaderIndex = std::find(predecessors.begin(), predecessors.end(), preheader) - predecessors.begin();
+  size_t latchIndex = 1 - preheaderIndex;
+
+  // Header values live on in the body and after the loop, where they now have one value per incoming edge
+  std::unordered_map<Inst*, Inst*> bodyValues;
+  std::unordered_map<Inst*, Inst*> exitValues;
+  Builder bodyBuilder(graph);
+  bodyBuilder.setAfter(body, nullptr);
+  Builder exitBuilder(graph);
+  exitBuilder.setAfter(exit, nullptr);
+  auto bodyValue = [&](Inst *inst) {
+    Inst *&phi = bodyValues[inst];
+    if (phi == nullptr) {
+      phi = bodyBuilder.pushPhi();
+      phi->type = resolveType(inst);
+    }
+    return phi;
+  };
+  auto exitValue = [&](Inst *inst) {
+    Inst *&phi = exitValues[inst];
+    if (phi == nullptr) {
+      phi = exitBuilder.pushPhi();
+      phi->type = resolveType(inst);
+    }
+    return phi;
+  };
+
+  std::vector<Inst*> values;
+  for (Inst *inst = header->first; inst != header->last; inst = inst->next) {
+    values.push_back(inst);
+  }
+  for (Inst *inst : values) {
+    std::vector<Inst*> users = inst->outputs;
+    std::sort(users.begin(), users.end());
+    users.erase(std::unique(users.begin(), users.end()), users.end());
+    for (Inst *user : users) {
+      if (user->block == header) continue;
+      for (size_t i = 0; i < user->inputs.size(); i++) {
+        if (user->inputs[i] != inst) continue;
+        Block *useBlock = user->kind == I_PHI ? user->block->predecessors[i] : user->block;
+        // Blocks that never return to the loop still hang off its body
+        user->replaceInput(i, body->dominates(useBlock) ? bodyValue(inst) : exitValue(inst));
+      }
+    }
+  }
+
+  std::unordered_map<Inst*, Inst*> preheaderValues;
+  std::unordered_map<Inst*, Inst*> latchValues;
+  for (Inst *inst = header->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+    preheaderValues[inst] = inst->inputs[preheaderIndex];
+    // The previous iteration's header values are the ones the body started with
+    Inst *latchInput = inst->inputs[latchIndex];
+    latchValues[inst] = latchInput->block == header ? bodyValue(latchInput) : latchInput;
+  }
+  cloneHeader(graph, header, preheader, preheaderValues);
+  cloneHeader(graph, header, latch, latchValues);
+
+  Inst *cond = header->last->inputs[0];
+  Block *whenTrue = header->successors[0];
+  Block *whenFalse = header->successors[1];
+  for (Block *successor : header->successors) {
+    auto &v = successor->predecessors;
+    v.erase(std::remove(v.begin(), v.end(), header), v.end());
+  }
+  header->successors.clear();
+
+  for (Block *block : {preheader, latch}) {
+    Inst *blockCond = lookup(block == preheader ? preheaderValues : latchValues, cond);
+    block->open = true;
+    block->last->destroy();
+    block->removeSuccessor(header);
+    Builder b(graph);
+    b.setBefore(block, nullptr);
+    b.pushIf(blockCond, whenTrue, whenFalse);
+  }
+  header->destroy();
+
+  for (auto *blockValues : {&bodyValues, &exitValues}) {
+    for (auto &value : *blockValues) {
+      Inst *phi = value.second;
+      for (Block *predecessor : phi->block->predecessors) {
+        phi->addInput(lookup(predecessor == preheader ? preheaderValues : latchValues, value.first));
+      }
+      phis.push_back(phi);
+    }
+  }
+  return true;
+}
+
+void Opt::rotateLoops(Graph &graph) {
+  std::vector<Inst*> phis;
+  bool changed = false;
+  for (Loop &loop : findLoops(graph)) {
+    changed = rotateLoop(graph, loop, phis) || changed;
+  }
+  if (!changed) return;
+
+  graph.removeOrphans();
+  graph.renumberBlocks();
+  graph.buildDominators();
+  removeTrivialPhis(std::move(phis));
+  simplifyCFG(graph);
+}
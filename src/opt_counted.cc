@@ -0,0 +1,357 @@
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "opt.h"
+
+using namespace IR;
+using namespace Opt;
+
+// Loops whose effect needs polynomials larger than this are left alone
+static const size_t maxPolyTerms = 32;
+static const size_t maxPolyDegree = 4;
+
+// A cell at a constant offset from the base of the loop as it was when the iteration started, or a value defined
+// outside of the loop
+struct Atom {
+  Inst *value = nullptr;
+  int64_t offset = 0;
+
+  [[nodiscard]] bool isCell() const { return value == nullptr; }
+
+  // Ordered by id rather than address so that the emitted code does not depend on the allocator
+  bool operator<(const Atom &other) const {
+    unsigned int id = value == nullptr ? 0 : value->id;
+    unsigned int otherId = other.value == nullptr ? 0 : other.value->id;
+    return id != otherId ? id < otherId : offset < other.offset;
+  }
+};
+
+typedef std::vector<Atom> Monomial;
+
+// Polynomial over atoms, coefficients wrap at the cell width
+struct Poly {
+  // The empty monomial holds the constant term, terms with a zero coefficient are never stored
+  std::map<Monomial, uint64_t> terms;
+
+  static Poly constant(uint64_t value) {
+    Poly poly;
+    if (value != 0) poly.terms[{}] = value;
+    return poly;
+  }
+
+  static Poly atom(Atom atom) {
+    Poly poly;
+    poly.terms[{atom}] = 1;
+    return poly;
+  }
+
+  [[nodiscard]] bool isZero() const { return terms.empty(); }
+
+  // Whether any term mentions a cell for which [pred] holds
+  template <typename Pred>
+  [[nodiscard]] bool mentionsCell(Pred pred) const {
+    for (auto &term : terms) {
+      for (const Atom &atom : term.first) {
+        if (atom.isCell() && pred(atom.offset)) return true;
+      }
+    }
+    return false;
+  }
+};
+
+struct CountedLoopEngine {
+  Graph &graph;
+  const Loop &loop;
+  TypeId cellType;
+  uint64_t mask;
+  Builder b;
+
+  Inst *base = nullptr;
+  int64_t counter = 0;
+  bool valid = true;
+
+  std::unordered_map<Inst*, Poly> values;
+  // Contents of every cell stored to by one iteration, in terms of the cells at the start of the iteration
+  std::map<int64_t, Poly> cells;
+
+  CountedLoopEngine(Graph &graph, const Loop &loop) :
+    graph(graph),
+    loop(loop),
+    cellType(typeForWidth(graph.config.cellWidth)),
+    mask(graph.config.cellWidth == 64 ? ~(uint64_t)0 : ((uint64_t)1 << graph.config.cellWidth) - 1),
+    b(graph) {}
+
+  // a + factor * b
+  Poly add(const Poly &x, const Poly &y, uint64_t factor) {
+    Poly result = x;
+    for (auto &term : y.terms) {
+      uint64_t &coefficient = result.terms[term.first];
+      coefficient = (coefficient + factor * term.second) & mask;
+      if (coefficient == 0) result.terms.erase(term.first);
+    }
+    if (result.terms.size() > maxPolyTerms) valid = false;
+    return result;
+  }
+
+  Poly mul(const Poly &x, const Poly &y) {
+    Poly result;
+    for (auto &left : x.terms) {
+      for (auto &right : y.terms) {
+        Monomial monomial = left.first;
+        monomial.insert(monomial.end(), right.first.begin(), right.first.end());
+        std::sort(monomial.begin(), monomial.end());
+        if (monomial.size() > maxPolyDegree) valid = false;
+        result = add(result, Poly{{{monomial, 1}}}, left.second * right.second);
+        if (!valid) return {};
+      }
+    }
+    return result;
+  }
+
+  // Replaces every cell of [poly] for which [replacements] holds a polynomial
+  Poly substitute(const Poly &poly, const std::map<int64_t, Poly> &replacements) {
+    Poly result;
+    for (auto &term : poly.terms) {
+      Poly product = Poly::constant(term.second);
+      for (const Atom &atom : term.first) {
+        auto replacement = atom.isCell() ? replacements.find(atom.offset) : replacements.end();
+        product = mul(product, replacement == replacements.end() ? Poly::atom(atom) : replacement->second);
+      }
+      result = add(result, product, 1);
+    }
+    return result;
+  }
+
+  Poly valueOf(Inst *inst) {
+    auto value = values.find(inst);
+    if (value != values.end()) return value->second;
+    if (inst->kind == I_IMM) return Poly::constant((uint64_t)inst->immValue & mask);
+    if (!loop.contains(inst->block) && resolveType(inst) == cellType) return Poly::atom({inst, 0});
+    valid = false;
+    return {};
+  }
+
+  // Offset of the cell at [address], which has to be relative to the base of the loop
+  int64_t offsetOf(Inst *address) {
+    auto location = locate(address);
+    if (location.base != base) valid = false;
+    return location.offset;
+  }
+
+  void execute(Block *block) {
+    for (Inst *inst = block->first; inst != nullptr && valid; inst = inst->next) {
+      switch (inst->kind) {
+        case I_IMM:
+        case I_GEP:
+        case I_IF:
+        case I_GOTO:
+          break;
+        case I_LD: {
+          int64_t offset = offsetOf(inst->inputs[0]);
+          auto cell = cells.find(offset);
+          values[inst] = cell == cells.end() ? Poly::atom({nullptr, offset}) : cell->second;
+          break;
+        } case I_STR:
+          // Stores truncate, which polynomials wrapping at the cell width can not express for wider values
+          if (resolveType(inst->inputs[1]) != cellType) valid = false;
+          cells[offsetOf(inst->inputs[0])] = valueOf(inst->inputs[1]);
+          break;
+        case I_ADD:
+        case I_SUB:
+        case I_MUL: {
+          if (resolveType(inst) != cellType || resolveType(inst->inputs[0]) != resolveType(inst->inputs[1])) {
+            valid = false;
+            break;
+          }
+          Poly x = valueOf(inst->inputs[0]);
+          Poly y = valueOf(inst->inputs[1]);
+          switch (inst->kind) {
+            case I_ADD: values[inst] = add(x, y, 1); break;
+            case I_SUB: values[inst] = add(x, y, mask); break;
+            default: values[inst] = mul(x, y); break;
+          }
+          break;
+        } default:
+          valid = false;
+          break;
+      }
+    }
+  }
+
+  Inst *address(int64_t offset) {
+    return offset == 0 ? base : b.pushGep(base, b.pushImm(offset, T_SIZE));
+  }
+
+  Inst *scale(Inst *value, uint64_t factor) {
+    if (factor == 1) return value;
+    return b.pushMul(value, b.pushImm(wrapImm((int64_t)factor, cellType), cellType));
+  }
+
+  // Builds [poly], loading the cells it mentions at the current position
+  Inst *emit(const Poly &poly) {
+    std::map<int64_t, Inst*> loaded;
+    Inst *sum = nullptr;
+    for (auto &term : poly.terms) {
+      Inst *product = nullptr;
+      for (const Atom &atom : term.first) {
+        Inst *value = atom.value;
+        if (atom.isCell()) {
+          Inst *&cell = loaded[atom.offset];
+          if (cell == nullptr) cell = b.pushLd(address(atom.offset));
+          value = cell;
+        }
+        product = product == nullptr ? value : b.pushMul(product, value);
+      }
+      if (product == nullptr) {
+        product = b.pushImm(wrapImm((int64_t)term.second, cellType), cellType);
+      } else {
+        product = scale(product, term.second);
+      }
+      sum = sum == nullptr ? product : b.pushAdd(sum, product);
+    }
+    return sum == nullptr ? b.pushImm(0, cellType) : sum;
+  }
+
+  // Adds [count] times the increment of each cell, then clears the counter
+  void emitIterations(Inst *count, const std::map<int64_t, Poly> &increments) {
+    for (auto &increment : increments) {
+      if (increment.first == counter || increment.second.isZero()) continue;
+      auto &terms = increment.second.terms;
+      bool constant = terms.size() == 1 && terms.begin()->first.empty();
+      Inst *step = constant ? scale(count, terms.begin()->second) : b.pushMul(count, emit(increment.second));
+      Inst *cellAddress = address(increment.first);
+      b.pushStr(cellAddress, b.pushAdd(b.pushLd(cellAddress), step));
+    }
+    b.pushStr(address(counter), b.pushImm(0, cellType));
+  }
+
+  // Inverse of an odd number modulo 2^64 by Newton's method, each step doubles the number of correct bits
+  static uint64_t inverse(uint64_t value) {
+    uint64_t result = value;
+    for (int i = 0; i < 5; i++) {
+      result *= 2 - value * result;
+    }
+    return result;
+  }
+
+  bool run() {
+    Block *header = loop.header;
+    Block *body = loop.latch;
+    if (body == nullptr || body == header || loop.blocks.size() != 2) return false;
+    if (header->last->kind != I_IF || header->predecessors.size() != 2 || header->successors[0] != body) return false;
+    if (body->last->kind != I_GOTO || body->predecessors.size() != 1) return false;
+    Block *exit = header->successors[1];
+    if (exit->predecessors.size() != 1) return false;
+
+    Inst *cond = header->last->inputs[0];
+    if (cond->kind != I_LD || cond->block != header) return false;
+    auto location = locate(cond->inputs[0]);
+    base = location.base;
+    counter = location.offset;
+    if (loop.contains(base->block)) return false;
+
+    // Values of the header, such as the condition, would hold something else after the loop than they used to
+    for (Inst *inst = header->first; inst != header->last; inst = inst->next) {
+      if (inst->kind == I_PHI || !instIsPure(inst->kind)) return false;
+      for (Inst *user : inst->outputs) {
+        if (user->block != header && user->block != body) return false;
+      }
+    }
+
+    execute(header);
+    execute(body);
+    if (!valid) return false;
+
+    // The counter has to step by an odd amount to reach zero from any value, which gives the trip count
+    auto counterCell = cells.find(counter);
+    if (counterCell == cells.end()) return false;
+    Poly step = add(counterCell->second, Poly::atom({nullptr, counter}), mask);
+    if (step.terms.size() != 1 || !step.terms.begin()->first.empty()) return false;
+    uint64_t delta = step.terms.begin()->second;
+    if ((delta & 1) == 0) return false;
+    uint64_t countFactor = (0 - inverse(delta)) & mask;
+
+    // Cells which change by the same amount on every iteration, in terms of cells which never change
+    std::map<int64_t, Poly> increments;
+    // Cells which are always assigned the same value, only depending on cells which never change
+    std::map<int64_t, Poly> fixed;
+    bool direct = true;
+    auto isStored = [&](int64_t offset) { return cells.contains(offset); };
+    for (auto &cell : cells) {
+      Poly increment = add(cell.second, Poly::atom({nullptr, cell.first}), mask);
+      if (!increment.mentionsCell(isStored)) {
+        increments[cell.first] = increment;
+      } else if (!cell.second.mentionsCell(isStored)) {
+        fixed[cell.first] = cell.second;
+        direct = false;
+      } else {
+        increments[cell.first] = increment;
+        direct = false;
+      }
+    }
+    if (!valid) return false;
+
+    if (direct) {
+      // The whole loop is a multiple of its increments, which adds nothing if it would not have run at all
+      b.setBefore(header->last);
+      emitIterations(scale(cond, countFactor), increments);
+      header->jumpTo(exit);
+      body->destroy();
+      return true;
+    }
+
+    // Otherwise the first iteration runs as is, after which fixed cells hold their value for good. Cells whose
+    // increment vanishes once those are in place then never change again either
+    std::set<int64_t> settled;
+    for (auto &cell : fixed) {
+      settled.insert(cell.first);
+    }
+    bool changed = true;
+    while (changed && valid) {
+      changed = false;
+      for (auto it = increments.begin(); it != increments.end();) {
+        if (it->first != counter && substitute(it->second, fixed).isZero()) {
+          settled.insert(it->first);
+          it = increments.erase(it);
+          changed = true;
+        } else {
+          it++;
+        }
+      }
+    }
+    auto isMoving = [&](int64_t offset) { return isStored(offset) && !settled.contains(offset); };
+    for (auto &increment : increments) {
+      if (increment.second.mentionsCell(isMoving)) return false;
+    }
+    if (!valid) return false;
+
+    // The remaining iterations continue from the cells left behind by the first one
+    b.setBefore(body->last);
+    Inst *remaining = b.pushLd(address(counter));
+    emitIterations(scale(remaining, countFactor), increments);
+    body->removeSuccessor(header);
+    body->addSuccessor(exit);
+    for (Inst *inst = exit->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+      inst->addInput(inst->inputs[0]);
+    }
+    return true;
+  }
+};
+
+void Opt::evaluateCountedLoops(Graph &graph) {
+  // Each round replaces the innermost loops, whose closed forms make up the straight-line bodies of the next ones
+  while (true) {
+    bool changed = false;
+    for (Loop &loop : findLoops(graph)) {
+      if (loop.header->orphan) continue;
+      changed = CountedLoopEngine(graph, loop).run() || changed;
+    }
+    if (!changed) return;
+
+    graph.removeOrphans();
+    graph.renumberBlocks();
+    graph.buildDominators();
+    simplifyCFG(graph);
+  }
+}
@@ -2,80 +2,190 @@
 
 using namespace IR;
 
-uint64_t instKey(Inst *inst) {
-  uint64_t kind = inst->kind;
-  uint64_t input0 = inst->inputs.empty() ? 0 : inst->inputs[0]->id & 0xFFFFu;
-  uint64_t input1 = inst->inputs.size() < 2 ? 0 : inst->inputs[1]->id & 0xFFFFu;
-  uint64_t imm = 0;
+struct CSEBlockState {
+  std::vector<Block*> children;
+  // Memory version at the end of the block
+  uint64_t exitVersion = 0;
+};
+
+static uint64_t hashCombine(uint64_t seed, uint64_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15u + (seed << 6u) + (seed >> 2u));
+}
+
+static uint64_t hashPointer(const void *pointer) {
+  return std::hash<const void*>()(pointer);
+}
+
+static bool isCommutative(InstKind kind) {
+  return kind == I_ADD || kind == I_MUL;
+}
+
+// Whether or not this instruction can be numbered, phis are only equal to other phis in the same block
+static bool isNumbered(InstKind kind) {
+  switch (kind) {
+    case I_IMM:
+    case I_ADD:
+    case I_SUB:
+    case I_MUL:
+    case I_DIV:
+    case I_MOD:
+    case I_LT:
+    case I_GEP:
+    case I_SELECT:
+    case I_LD:
+    case I_PHI:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint64_t instHash(Inst *inst) {
+  uint64_t hash = hashCombine(inst->kind, inst->type);
   switch (inst->kind) {
     case I_IMM:
-      imm = (uint64_t)inst->immValue & 0xFFFFu;
+      return hashCombine(hash, (uint64_t)inst->immValue);
+    case I_LD:
+      hash = hashCombine(hash, (uintptr_t)inst->passData);
       break;
-    case I_REG:
-      imm = inst->immReg;
+    case I_PHI:
+      hash = hashCombine(hash, hashPointer(inst->block));
       break;
     default:
       break;
   }
-  return (kind << 48u) | (input0 << 32u) | (input1 << 16u) | imm;
+  if (isCommutative(inst->kind)) {
+    // Order independent combination of both operands
+    return hashCombine(hash, hashPointer(inst->inputs[0]) + hashPointer(inst->inputs[1]));
+  }
+  for (Inst *input : inst->inputs) {
+    hash = hashCombine(hash, hashPointer(input));
+  }
+  return hash;
 }
 
-bool instEqual(Inst *a, Inst *b) {
-  if (a->kind != b->kind || a->inputs.size() != b->inputs.size()) return false;
-
-  Inst *aInput0 = a->inputs.empty() ? nullptr : a->inputs[0];
-  Inst *bInput0 = b->inputs.empty() ? nullptr : b->inputs[0];
-  if (aInput0 != bInput0) return false;
-
-  Inst *aInput1 = a->inputs.size() < 2 ? nullptr : a->inputs[1];
-  Inst *bInput1 = b->inputs.size() < 2 ? nullptr : b->inputs[1];
-  if (aInput1 != bInput1) return false;
-
-  return true;
+static bool instEqual(Inst *a, Inst *b) {
+  if (a->kind != b->kind || a->type != b->type || a->inputs.size() != b->inputs.size()) return false;
+  switch (a->kind) {
+    case I_IMM:
+      return a->immValue == b->immValue;
+    case I_LD:
+      if (a->passData != b->passData) return false;
+      break;
+    case I_PHI:
+      if (a->block != b->block) return false;
+      break;
+    default:
+      break;
+  }
+  if (a->inputs == b->inputs) return true;
+  return isCommutative(a->kind) && a->inputs[0] == b->inputs[1] && a->inputs[1] == b->inputs[0];
 }
 
+// Global value numbering over the dominator tree, with a scoped table of available expressions
 struct CSEEngine {
-  std::unordered_map<uint64_t, std::vector<Inst*>> cache;
-
-  Inst *optimizeInst(Inst *inst) {
-    uint64_t key = instKey(inst);
-    auto &vec = cache[key];
-    
-    for (Inst *candidate : vec) {
-      assert(inst != candidate);
-      if (instEqual(inst, candidate)) {
-        // Because we optimize predecessors first, this should not affect existing keys
-        inst->rewriteWith(candidate);
-        return candidate;
-      }
-    }
+  Graph &graph;
 
-    vec.push_back(inst);
-    return inst;
-  }
+  std::unordered_map<uint64_t, std::vector<Inst*>> available;
+  // Hashes pushed into available, in order, so scopes can be popped
+  std::vector<uint64_t> pushed;
+
+  uint64_t nextVersion = 1;
 
-  std::unordered_set<Block*> visitedBlocks;
+  explicit CSEEngine(Graph &graph) : graph(graph) {}
 
-  void optimizeBlock(Block *block) {
-    if (visitedBlocks.contains(block)) {
-      return;
-    } else {
-      visitedBlocks.insert(block);
+  // Returns an equivalent instruction which dominates [inst], or makes [inst] available
+  Inst *find(Inst *inst) {
+    uint64_t hash = instHash(inst);
+    auto &candidates = available[hash];
+    for (Inst *candidate : candidates) {
+      if (instEqual(inst, candidate)) return candidate;
     }
+    candidates.push_back(inst);
+    pushed.push_back(hash);
+    return nullptr;
+  }
 
+  void optimizeBlock(Block *block, uint64_t &version) {
     Inst *inst = block->first;
     while (inst != nullptr) {
       Inst *next = inst->next;
-      if (instIsPure(inst->kind)) {
-        optimizeInst(inst);
+      if (instMayStore(inst->kind)) {
+        version = nextVersion++;
+      } else if (isNumbered(inst->kind)) {
+        if (inst->type == T_INVALID) Opt::resolveType(inst);
+        if (inst->kind == I_LD) {
+          // Loads are only equal if no store could have happened in between
+          inst->passData = (void*)(uintptr_t)version;
+        }
+        Inst *replacement = inst->kind == I_PHI ? Opt::trivialPhiInput(inst) : nullptr;
+        if (replacement == nullptr) replacement = find(inst);
+        if (replacement != nullptr) {
+          inst->rewriteWith(replacement);
+        }
       }
       inst = next;
     }
   }
+
+  void run() {
+    if (!graph.builtDominators) graph.buildDominators();
+    graph.clearPassData();
+
+    for (Block *block : graph.blocks) {
+      if (block->orphan) continue;
+      block->passData = new CSEBlockState();
+    }
+    // Blocks without a dominator other than the entry are unreachable and left alone
+    for (Block *block : graph.blocks) {
+      if (block->orphan || block->dominator == nullptr) continue;
+      ((CSEBlockState*)block->dominator->passData)->children.push_back(block);
+    }
+
+    struct Frame {
+      Block *block;
+      size_t scope;
+      size_t child;
+    };
+
+    std::vector<Frame> stack;
+    auto enter = [&](Block *block) {
+      auto state = (CSEBlockState*)block->passData;
+      // Memory is only unchanged from the end of the dominator if it is the only way into this block
+      uint64_t version;
+      if (block->predecessors.size() == 1 && block->predecessors[0] == block->dominator) {
+        version = ((CSEBlockState*)block->dominator->passData)->exitVersion;
+      } else {
+        version = nextVersion++;
+      }
+      stack.push_back({block, pushed.size(), 0});
+      optimizeBlock(block, version);
+      state->exitVersion = version;
+    };
+
+    enter(graph.blocks[0]);
+    while (!stack.empty()) {
+      Frame &frame = stack.back();
+      auto state = (CSEBlockState*)frame.block->passData;
+      if (frame.child < state->children.size()) {
+        enter(state->children[frame.child++]);
+      } else {
+        while (pushed.size() > frame.scope) {
+          available[pushed.back()].pop_back();
+          pushed.pop_back();
+        }
+        stack.pop_back();
+      }
+    }
+
+    for (Block *block : graph.blocks) {
+      delete (CSEBlockState*)block->passData;
+      block->passData = nullptr;
+    }
+    graph.clearPassData();
+  }
 };
 
 void Opt::optimizeCommonExpr(Graph &graph) {
-  CSEEngine cse;
-  cse.optimizeBlock(graph.blocks[0]);
-
-}
\ No newline at end of file
+  CSEEngine(graph).run();
+}
@@ -15,7 +15,12 @@ bool Opt::equal(IR::Inst *a, IR::Inst *b) {
       return a->immValue == b->immValue;
     case I_ADD:
     case I_SUB:
+    case I_MUL:
+    case I_DIV:
+    case I_MOD:
+    case I_LT:
     case I_GEP:
+    case I_SELECT:
     case I_LD:
       for (int i = 0; i < a->inputs.size(); i++) {
         if (!equal(a->inputs[i], b->inputs[i])) {
@@ -30,15 +35,23 @@ bool Opt::equal(IR::Inst *a, IR::Inst *b) {
       return false;
     case I_IF:
     case I_PUTCHAR:
+    case I_WRITE:
+    case I_CALL:
     case I_GOTO:
     case I_RET:
     case I_STR:
+    case I_FILL:
+    case I_COPY:
+    case I_VSTR:
+    case I_VADD:
       abort();
   }
   abort();
 }
 
-void foldInst(FoldState &state) {
+// Applies the first matching rule to state.inst, returning its replacement, state.inst itself if it was modified in
+// place, or null if no rule matched
+static Inst *applyRules(FoldState &state) {
   Inst *inst = state.inst;
   size_t inputCount = inst->inputs.size();
   Inst *left = inputCount < 1 ? nullptr : inst->inputs[0];
@@ -47,52 +60,165 @@ void foldInst(FoldState &state) {
   state.right = right;
   InstKind leftKind = inputCount < 1 ? I_NOP : left->kind;
   InstKind rightKind = inputCount < 2 ? I_NOP : right->kind;
-  FoldKey key = {inst->kind, leftKind, rightKind};
-  uint64_t lastKey = 0;
-
-  for (unsigned int i = 0; i < 4; i++) {
-    uint64_t maskedKey = key.value;
-    if ((i & 1u) != 0) {
-      maskedKey &= ~0xFFu;
-    } else if ((i & 10u) != 0) {
-      maskedKey &= ~0xFF00u;
+
+  for (uint8_t rule : state.rules.lookup(inst->kind, leftKind, rightKind)) {
+    if (rule == 0) break;
+    state.b.setBefore(inst);
+    Inst *result = state.rules.folders[rule](state);
+    if (result != nullptr) return result;
+  }
+  return nullptr;
+}
+
+// Rule applications allowed per instruction of the graph, rules only ever simplify but this guarantees termination
+// even if two of them were to undo each other
+static const size_t foldStepsPerInst = 16;
+
+// Folds instructions until no rule matches anywhere, revisiting the users of every instruction that changed
+struct FoldEngine {
+  Graph &graph;
+  FoldState state;
+
+  std::vector<Inst*> worklist;
+  // Instructions in the worklist, destroyed instructions are erased so stale worklist entries are skipped
+  std::unordered_set<Inst*> queued;
+
+  size_t steps = 0;
+  size_t maxSteps = 0;
+
+  FoldEngine(Graph &graph, const FoldRules &rules) : graph(graph), state(graph, rules) {}
+
+  void enqueue(Inst *inst) {
+    if (queued.insert(inst).second) worklist.push_back(inst);
+  }
+
+  void enqueueUsers(const std::vector<Inst*> &users) {
+    for (Inst *user : users) enqueue(user);
+  }
+
+  // Instructions built by a rule are placed right before the instruction being folded
+  void enqueueBuilt(Inst *inst, unsigned int firstNewId) {
+    for (Inst *cur = inst->prev; cur != nullptr && cur->id >= firstNewId; cur = cur->prev) {
+      enqueue(cur);
+    }
+  }
+
+  void visit(Inst *inst) {
+    if (inst->kind == I_PHI) {
+      Inst *input = trivialPhiInput(inst);
+      if (input == nullptr) return;
+      std::vector<Inst*> users = inst->outputs;
+      // A phi of a loop header may use itself
+      std::erase(users, inst);
+      inst->rewriteWith(input);
+      enqueueUsers(users);
+      return;
     }
-    if (maskedKey == lastKey) continue;
-    lastKey = maskedKey;
-    if (state.rules.folders.count(maskedKey)) {
-      state.b.setBefore(inst);
-      Inst *result = state.rules.folders.at(maskedKey)(state);
-
-      if (result == nullptr) {
-        // No match, continue
+
+    bool modified = false;
+    while (steps++ < maxSteps) {
+      unsigned int firstNewId = graph.nextInstId;
+      state.inst = inst;
+      Inst *result = applyRules(state);
+      if (result == nullptr) break;
+      enqueueBuilt(inst, firstNewId);
+      if (result == inst) {
+        // Modified in place, try the rules again on its new form
+        modified = true;
         continue;
-      } else if (result == inst) {
-        // Instruction was modified in-place, retry fold
-        return foldInst(state);
-      } else {
-        // Done, rewrite
-        state.inst->rewriteWith(result);
-        return;
       }
+      std::vector<Inst*> users = inst->outputs;
+      queued.erase(inst);
+      inst->rewriteWith(result);
+      enqueueUsers(users);
+      return;
     }
+    if (modified) enqueueUsers(inst->outputs);
   }
-}
 
-void Opt::fold(Graph &graph, const FoldRules &rules) {
-  FoldState state(graph, rules);
-  for (Block *block : graph.blocks) {
-    state.inst = block->first;
-    while (state.inst != nullptr) {
-      Inst *next = state.inst->next;
-      foldInst(state);
-      state.inst = next;
+  void run() {
+    size_t count = 0;
+    for (Block *block : graph.blocks) {
+      for (Inst *inst = block->first; inst != nullptr; inst = inst->next) count++;
+    }
+    maxSteps = count * foldStepsPerInst;
+
+    // Seeded in reverse so instructions are first visited in program order
+    for (auto it = graph.blocks.rbegin(); it != graph.blocks.rend(); it++) {
+      for (Inst *inst = (*it)->last; inst != nullptr; inst = inst->prev) enqueue(inst);
+    }
+
+    while (!worklist.empty() && steps < maxSteps) {
+      Inst *inst = worklist.back();
+      worklist.pop_back();
+      // Skips entries of instructions destroyed since they were queued
+      if (queued.erase(inst) == 0) continue;
+      visit(inst);
     }
   }
+};
+
+void Opt::fold(Graph &graph, const FoldRules &rules) {
+  FoldEngine(graph, rules).run();
 }
 
-FoldRules Opt::standardFoldRules() {
+int64_t Opt::wrapImm(int64_t value, TypeId type) {
+  switch (type) {
+    case T_I8: return (int8_t)value;
+    case T_I16: return (int16_t)value;
+    case T_I32: return (int32_t)value;
+    default: return value;
+  }
+}
+
+// Whether [a] and [b] are known to hold the same value
+static bool same(Inst *a, Inst *b) {
+  if (a == b) return true;
+  return a->kind == I_IMM && b->kind == I_IMM && a->immValue == b->immValue && a->type == b->type;
+}
+
+// Whether every operand has the type of the result, so arithmetic on them wraps the same way
+static bool uniform(Inst *inst) {
+  TypeId type = resolveType(inst);
+  for (Inst *input : inst->inputs) {
+    if (resolveType(input) != type) return false;
+  }
+  return true;
+}
+
+// Splits x + imm and x - imm into x and a signed offset, anything else has an offset of 0
+static Inst *splitOffset(Inst *inst, int64_t &offset) {
+  offset = 0;
+  if ((inst->kind != I_ADD && inst->kind != I_SUB) || inst->inputs[1]->kind != I_IMM || !uniform(inst)) return inst;
+  offset = inst->kind == I_ADD ? inst->inputs[1]->immValue : -inst->inputs[1]->immValue;
+  return inst->inputs[0];
+}
+
+// Builds x + offset, as a subtraction if the offset is negative
+static Inst *pushOffset(FoldState &s, Inst *x, int64_t offset, TypeId type) {
+  offset = wrapImm(offset, type);
+  if (offset == 0) return x;
+  if (offset < 0 && offset != INT64_MIN) return s.b.pushSub(x, s.b.pushImm(-offset, type));
+  return s.b.pushAdd(x, s.b.pushImm(offset, type));
+}
+
+// Loads forwarded from a store need to find it within this many instructions
+static const int loadForwardDistance = 16;
+
+static constexpr FoldRules buildStandardRules() {
   FoldRules rules;
 
+  // Immediates
+
+  rules.add({{I_IMM}}, [](FoldState &s) -> Inst* {
+    if (s.inst->type < T_LOW || s.inst->type > T_HI) return nullptr;
+    int64_t wrapped = wrapImm(s.inst->immValue, s.inst->type);
+    if (wrapped == s.inst->immValue) return nullptr;
+    // 256 -> 0 for i8
+    s.inst->immValue = wrapped;
+    return s.inst;
+  });
+
   // Optimize GEP
 
   rules.add({{I_GEP, I_GEP, I_IMM}}, [](FoldState &s) -> Inst* {
@@ -114,5 +240,148 @@ FoldRules Opt::standardFoldRules() {
     return nullptr;
   });
 
+  // Arithmetic on immediates
+
+  rules.add({{I_ADD, I_IMM, I_IMM}, {I_SUB, I_IMM, I_IMM}, {I_MUL, I_IMM, I_IMM}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst)) return nullptr;
+    TypeId type = resolveType(s.inst);
+    // imm x + imm y -> imm x + y
+    auto x = (uint64_t)s.left->immValue;
+    auto y = (uint64_t)s.right->immValue;
+    uint64_t result;
+    switch (s.inst->kind) {
+      case I_ADD: result = x + y; break;
+      case I_SUB: result = x - y; break;
+      default: result = x * y; break;
+    }
+    return s.b.pushImm(wrapImm((int64_t)result, type), type);
+  });
+
+  rules.add({{I_DIV, I_IMM, I_IMM}, {I_MOD, I_IMM, I_IMM}, {I_LT, I_IMM, I_IMM}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst)) return nullptr;
+    TypeId type = resolveType(s.inst);
+    if (type < T_LOW || type > T_HI) return nullptr;
+    // Immediates are sign extended, these operations are unsigned
+    uint64_t mask = type == T_I64 ? ~(uint64_t)0 : ((uint64_t)1 << (8u << (type - T_LOW))) - 1;
+    uint64_t x = (uint64_t)s.left->immValue & mask;
+    uint64_t y = (uint64_t)s.right->immValue & mask;
+    uint64_t result;
+    switch (s.inst->kind) {
+      case I_DIV: result = y == 0 ? x : x / y; break;
+      case I_MOD: result = y == 0 ? 0 : x % y; break;
+      default: result = x < y; break;
+    }
+    return s.b.pushImm(wrapImm((int64_t)result, type), type);
+  });
+
+  rules.add({{I_ADD, I_IMM, I_NOP}, {I_MUL, I_IMM, I_NOP}}, [](FoldState &s) -> Inst* {
+    if (s.right->kind == I_IMM) return nullptr;
+    // imm x + y -> y + imm x
+    std::swap(s.inst->inputs[0], s.inst->inputs[1]);
+    return s.inst;
+  });
+
+  rules.add({{I_MUL, I_NOP, I_IMM}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst)) return nullptr;
+    TypeId type = resolveType(s.inst);
+    // x * imm 1 -> x, x * imm 0 -> imm 0
+    int64_t factor = wrapImm(s.right->immValue, type);
+    if (factor == 1) return s.left;
+    if (factor == 0) return s.b.pushImm(0, type);
+    return nullptr;
+  });
+
+  rules.add({{I_ADD, I_NOP, I_IMM}, {I_SUB, I_NOP, I_IMM}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst)) return nullptr;
+    TypeId type = resolveType(s.inst);
+    // (x + imm a) - imm b -> x + (a - b), x + imm 0 -> x
+    int64_t inner;
+    Inst *x = splitOffset(s.left, inner);
+    if (resolveType(x) != type) return nullptr;
+    int64_t offset = wrapImm(inner + (s.inst->kind == I_ADD ? s.right->immValue : -s.right->immValue), type);
+    if (offset == 0) return x;
+    if (x == s.left) return nullptr;
+    return pushOffset(s, x, offset, type);
+  });
+
+  // Reassociation and cancellation
+
+  rules.add({{I_ADD, I_ADD, I_NOP}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst) || !uniform(s.left)) return nullptr;
+    Inst *x = s.left->inputs[0];
+    Inst *offset = s.left->inputs[1];
+    if (offset->kind != I_IMM || s.right->kind == I_IMM || s.left->outputs.size() != 1) return nullptr;
+    // (x + imm a) + y -> (x + y) + imm a, so that immediates of a chain end up next to each other
+    s.inst->replaceInput(0, s.b.pushAdd(x, s.right));
+    s.inst->replaceInput(1, offset);
+    return s.inst;
+  });
+
+  rules.add({{I_ADD, I_SUB, I_NOP}, {I_SUB, I_ADD, I_NOP}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst) || !uniform(s.left)) return nullptr;
+    // (x - y) + y -> x, (x + y) - y -> x
+    if (same(s.left->inputs[1], s.right)) return s.left->inputs[0];
+    // (y + x) - y -> x
+    if (s.inst->kind == I_SUB && same(s.left->inputs[0], s.right)) return s.left->inputs[1];
+    return nullptr;
+  });
+
+  rules.add({{I_ADD, I_NOP, I_SUB}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst) || !uniform(s.right)) return nullptr;
+    // y + (x - y) -> x
+    if (same(s.right->inputs[1], s.left)) return s.right->inputs[0];
+    return nullptr;
+  });
+
+  rules.add({{I_SUB}}, [](FoldState &s) -> Inst* {
+    if (!uniform(s.inst) || !same(s.left, s.right)) return nullptr;
+    // x - x -> 0
+    TypeId type = resolveType(s.inst);
+    return s.b.pushImm(0, type);
+  });
+
+  // Selects
+
+  rules.add({{I_SELECT, I_IMM, I_NOP}}, [](FoldState &s) -> Inst* {
+    // imm ? x : y -> x or y
+    TypeId cellType = typeForWidth(s.inst->block->graph->config.cellWidth);
+    Inst *value = s.inst->inputs[wrapImm(s.left->immValue, cellType) != 0 ? 1 : 2];
+    return resolveType(value) == resolveType(s.inst) ? value : nullptr;
+  });
+
+  rules.add({{I_SELECT}}, [](FoldState &s) -> Inst* {
+    // c ? x : x -> x
+    if (!same(s.right, s.inst->inputs[2]) || resolveType(s.right) != resolveType(s.inst)) return nullptr;
+    return s.right;
+  });
+
+  // Memory
+
+  rules.add({{I_LD}}, [](FoldState &s) -> Inst* {
+    // [x] <- y; ... [x] -> y, as long as nothing in between may store to x
+    auto location = locate(s.left);
+    Inst *cur = s.inst->prev;
+    for (int i = 0; cur != nullptr && i < loadForwardDistance; cur = cur->prev, i++) {
+      if (cur->kind == I_STR) {
+        auto stored = locate(cur->inputs[0]);
+        if (stored == location) {
+          Inst *value = cur->inputs[1];
+          // Stores truncate, a wider value is not the same as what a load sees
+          return resolveType(value) == resolveType(s.inst) ? value : nullptr;
+        }
+        if (stored.base != location.base) return nullptr;
+      } else if (instMayStore(cur->kind)) {
+        return nullptr;
+      }
+    }
+    return nullptr;
+  });
+
   return rules;
-}
\ No newline at end of file
+}
+
+static constexpr FoldRules standardRules = buildStandardRules();
+
+const FoldRules &Opt::standardFoldRules() {
+  return standardRules;
+}
@@ -0,0 +1,232 @@
+#include <algorithm>
+
+#include "opt.h"
+
+using namespace IR;
+using namespace Opt;
+
+// Bodies with more instructions than this, not counting immediates, keep their branch instead of being executed unconditionally
+static const size_t maxSelectBodySize = 16;
+
+// Whether the cell at [location] holds zero when [block] is entered through the false edge of [predecessor]
+static bool leftZero(Block *predecessor, Block *block, const Location &location) {
+  Inst *branch = predecessor->last;
+  if (branch->kind != I_IF || predecessor->successors[1] != block || predecessor->successors[0] == block) return false;
+  Inst *cond = branch->inputs[0];
+  if (cond->kind != I_LD || cond->block != predecessor || locate(cond->inputs[0]) != location) return false;
+  for (Inst *inst = cond->next; inst != branch; inst = inst->next) {
+    if (instMayStore(inst->kind)) return false;
+  }
+  return true;
+}
+
+// Whether the cell at [location] holds zero at the end of [block], given whether it did when entering it
+static bool zeroAfter(Block *block, const Location &location, bool zero, TypeId cellType) {
+  for (Inst *inst = block->first; inst != nullptr; inst = inst->next) {
+    if (inst->kind == I_STR) {
+      auto stored = locate(inst->inputs[0]);
+      Inst *value = inst->inputs[1];
+      if (stored == location) {
+        // Stores truncate to the cell width
+        zero = value->kind == I_IMM && wrapImm(value->immValue, cellType) == 0;
+      } else if (stored.base != location.base) {
+        zero = false;
+      }
+    } else if (instMayStore(inst->kind)) {
+      zero = false;
+    }
+  }
+  return zero;
+}
+
+// Whether every path through the body of [loop] leaves the cell at [location] holding zero when reaching the latch
+static bool clearsCell(const Loop &loop, const Location &location, TypeId cellType) {
+  // Starts out assuming every block clears the cell and refutes it until nothing changes
+  std::unordered_map<Block*, bool> zeroAtEnd;
+  for (Block *block : loop.blocks) {
+    zeroAtEnd[block] = true;
+  }
+  zeroAtEnd[loop.header] = zeroAfter(loop.header, location, false, cellType);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (Block *block : loop.blocks) {
+      if (block == loop.header || block->orphan) continue;
+      bool zero = true;
+      for (Block *predecessor : block->predecessors) {
+        if (leftZero(predecessor, block, location)) continue;
+        auto known = zeroAtEnd.find(predecessor);
+        zero = zero && known != zeroAtEnd.end() && known->second;
+      }
+      zero = zeroAfter(block, location, zero, cellType);
+      if (zero != zeroAtEnd[block]) {
+        zeroAtEnd[block] = zero;
+        changed = true;
+      }
+    }
+  }
+  return zeroAtEnd[loop.latch];
+}
+
+static Block *useBlock(Inst *user, size_t input) {
+  return user->kind == I_PHI ? user->block->predecessors[input] : user->block;
+}
+
+// Whether [body] is a single block of arithmetic, loads and stores that is cheap enough to always execute
+static bool isSimpleBody(Block *body) {
+  size_t size = 0;
+  for (Inst *inst = body->first; inst != body->last; inst = inst->next) {
+    if (inst->kind == I_PHI || (!instIsPure(inst->kind) && inst->kind != I_STR)) return false;
+    if (inst->kind != I_IMM && ++size > maxSelectBodySize) return false;
+  }
+  return true;
+}
+
+// Moves the body of a forward conditional into [header] and removes the branch, stores of the body and values
+// flowing into [exit] pick between the old and the new value depending on the condition
+static bool speculate(Graph &graph, Block *header) {
+  Inst *branch = header->last;
+  if (branch->kind != I_IF) return false;
+  Block *body = header->successors[0];
+  Block *exit = header->successors[1];
+  if (body == exit || body->predecessors.size() != 1 || exit->predecessors.size() != 2) return false;
+  if (body->last->kind != I_GOTO || body->successors[0] != exit || !isSimpleBody(body)) return false;
+
+  Inst *cond = branch->inputs[0];
+  Builder b(graph);
+  while (body->first != body->last) {
+    Inst *inst = body->first;
+    header->moveBefore(inst, branch);
+    if (inst->kind == I_STR) {
+      b.setBefore(inst);
+      Inst *old = b.pushLd(inst->inputs[0]);
+      inst->replaceInput(1, b.pushSelect(cond, inst->inputs[1], old));
+    }
+  }
+
+  auto &predecessors = exit->predecessors;
+  size_t headerIndex = std::find(predecessors.begin(), predecessors.end(), header) - predecessors.begin();
+  size_t bodyIndex = 1 - headerIndex;
+  b.setBefore(branch);
+  while (exit->first != nullptr && exit->first->kind == I_PHI) {
+    Inst *phi = exit->first;
+    Inst *taken = phi->inputs[bodyIndex];
+    Inst *skipped = phi->inputs[headerIndex];
+    phi->rewriteWith(taken == skipped ? taken : b.pushSelect(cond, taken, skipped));
+  }
+
+  header->jumpTo(exit);
+  body->destroy();
+  return true;
+}
+
+// Removes the back edge of a loop whose body always clears the cell holding its condition, so it runs at most once
+static bool convertLoop(Graph &graph, const Loop &loop, std::vector<Inst*> &phis) {
+  Block *header = loop.header;
+  Block *latch = loop.latch;
+  if (latch == nullptr || latch == header || latch->last->kind != I_GOTO) return false;
+  if (header->last->kind != I_IF || header->predecessors.size() != 2) return false;
+
+  Block *body = header->successors[0];
+  Block *exit = header->successors[1];
+  if (!loop.contains(body) || loop.contains(exit) || exit->predecessors.size() != 1) return false;
+
+  Inst *cond = header->last->inputs[0];
+  if (cond->kind != I_LD || cond->block != header) return false;
+  auto location = locate(cond->inputs[0]);
+  if (loop.contains(location.base->block)) return false;
+
+  // Past the exit, values computed by the header would now have to come from either its first or its second run
+  for (Inst *inst = header->first; inst != header->last; inst = inst->next) {
+    if (!instIsPure(inst->kind)) return false;
+    if (inst->kind == I_PHI) continue;
+    for (Inst *user : inst->outputs) {
+      for (size_t i = 0; i < user->inputs.size(); i++) {
+        if (user->inputs[i] == inst && exit->dominates(useBlock(user, i))) return false;
+      }
+    }
+  }
+
+  TypeId cellType = typeForWidth(graph.config.cellWidth);
+  if (!clearsCell(loop, location, cellType)) return false;
+
+  auto &predecessors = header->predecessors;
+  size_t latchIndex = std::find(predecessors.begin(), predecessors.end(), latch) - predecessors.begin();
+  size_t enteringIndex = 1 - latchIndex;
+
+  // The header now runs once, its phis hold their initial value in the loop and either value after it
+  std::vector<Inst*> headerPhis;
+  std::vector<Inst*> entering;
+  std::vector<Inst*> latchValues;
+  for (Inst *inst = header->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+    headerPhis.push_back(inst);
+    entering.push_back(inst->inputs[enteringIndex]);
+  }
+  for (Inst *phi : headerPhis) {
+    Inst *value = phi->inputs[latchIndex];
+    auto carried = std::find(headerPhis.begin(), headerPhis.end(), value);
+    latchValues.push_back(carried == headerPhis.end() ? value : entering[carried - headerPhis.begin()]);
+  }
+
+  latch->removeSuccessor(header);
+  latch->addSuccessor(exit);
+  for (Inst *inst = exit->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+    inst->addInput(inst->inputs[0]);
+  }
+
+  Builder b(graph);
+  b.setAfter(exit, nullptr);
+  for (size_t i = 0; i < headerPhis.size(); i++) {
+    Inst *phi = headerPhis[i];
+    Inst *exitPhi = b.pushPhi();
+    exitPhi->type = resolveType(phi);
+    exitPhi->addInput(entering[i]);
+    exitPhi->addInput(latchValues[i]);
+    phis.push_back(exitPhi);
+
+    std::vector<Inst*> users = phi->outputs;
+    std::sort(users.begin(), users.end());
+    users.erase(std::unique(users.begin(), users.end()), users.end());
+    for (Inst *user : users) {
+      if (user == phi) continue;
+      for (size_t j = 0; j < user->inputs.size(); j++) {
+        if (user->inputs[j] != phi) continue;
+        user->replaceInput(j, exit->dominates(useBlock(user, j)) ? exitPhi : entering[i]);
+      }
+    }
+  }
+  for (Inst *phi : headerPhis) {
+    phi->destroy();
+  }
+
+  return true;
+}
+
+void Opt::convertIfLoops(Graph &graph) {
+  std::vector<Inst*> phis;
+  bool changed = false;
+  for (Loop &loop : findLoops(graph)) {
+    changed = convertLoop(graph, loop, phis) || changed;
+  }
+  if (!changed) return;
+
+  // The latch now branches forward to the exit, which may have a lower id
+  graph.removeOrphans();
+  graph.renumberBlocks();
+  graph.buildDominators();
+  removeTrivialPhis(std::move(phis));
+  simplifyCFG(graph);
+
+  // Inner conditionals come first, merging what is left of them can make the body around them simple as well
+  while (true) {
+    bool speculated = false;
+    for (auto it = graph.blocks.rbegin(); it != graph.blocks.rend(); it++) {
+      if ((*it)->orphan) continue;
+      speculated = speculate(graph, *it) || speculated;
+    }
+    if (!speculated) break;
+    graph.removeOrphans();
+    simplifyCFG(graph);
+  }
+}
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "opt.h"
+
+using namespace IR;
+using namespace Opt;
+
+std::vector<Induction> Opt::findInductions(const Loop &loop) {
+  std::vector<Induction> inductions;
+  Block *header = loop.header;
+  if (loop.preheader == nullptr || loop.latch == nullptr || header->predecessors.size() != 2) return inductions;
+
+  auto &predecessors = header->predecessors;
+  size_t latchIndex = std::find(predecessors.begin(), predecessors.end(), loop.latch) - predecessors.begin();
+  size_t preheaderIndex = 1 - latchIndex;
+
+  for (Inst *phi = header->first; phi != nullptr && phi->kind == I_PHI; phi = phi->next) {
+    Inst *next = phi->inputs[latchIndex];
+    Induction induction;
+    induction.phi = phi;
+    induction.start = phi->inputs[preheaderIndex];
+    if (next->kind == I_GEP) {
+      auto location = locate(next);
+      if (location.base != phi) continue;
+      induction.pointer = true;
+      induction.step = location.offset;
+    } else if ((next->kind == I_ADD || next->kind == I_SUB) && next->inputs[0] == phi && next->inputs[1]->kind == I_IMM) {
+      int64_t step = next->inputs[1]->immValue;
+      induction.step = next->kind == I_ADD ? step : -step;
+    } else {
+      continue;
+    }
+    if (induction.step != 0) inductions.push_back(induction);
+  }
+  return inductions;
+}
+
+// Blocks of [loop] in the order each iteration runs them, empty unless the loop is a single path from the header to
+// the latch
+static std::vector<Block*> iterationPath(const Loop &loop) {
+  std::vector<Block*> path = {loop.header};
+  Block *block = loop.header;
+  while (block != loop.latch) {
+    Block *next = nullptr;
+    for (Block *successor : block->successors) {
+      if (!loop.contains(successor)) continue;
+      if (next != nullptr) return {};
+      next = successor;
+    }
+    if (next == nullptr || next->predecessors.size() != 1) return {};
+    path.push_back(next);
+    block = next;
+  }
+  if (path.size() != loop.blocks.size()) return {};
+  return path;
+}
+
+// Replaces loads of cells that the previous iteration of a loop moving the pointer by a constant left in a register,
+// by a header phi of that value
+static bool forwardCarriedCells(Graph &graph, const Loop &loop) {
+  auto path = iterationPath(loop);
+  if (path.empty()) return false;
+  TypeId cellType = typeForWidth(graph.config.cellWidth);
+
+  for (Induction &induction : findInductions(loop)) {
+    if (!induction.pointer) continue;
+    Inst *pointer = induction.phi;
+
+    // Every iteration accesses a window of cells at fixed offsets from the pointer, which the next one sees
+    // shifted by the step
+    std::map<int64_t, std::vector<Inst*>> entryLoads;
+    std::map<int64_t, Inst*> exitValues;
+    std::set<int64_t> stored;
+    bool affine = true;
+    for (Block *block : path) {
+      for (Inst *inst = block->first; inst != nullptr && affine; inst = inst->next) {
+        if (inst->kind != I_LD && inst->kind != I_STR) {
+          affine = !instMayStore(inst->kind) && !instMayLoad(inst->kind);
+          continue;
+        }
+        auto location = locate(inst->inputs[0]);
+        if (location.base != pointer) {
+          affine = false;
+        } else if (inst->kind == I_LD) {
+          if (stored.contains(location.offset)) continue;
+          entryLoads[location.offset].push_back(inst);
+          exitValues.emplace(location.offset, inst);
+        } else {
+          // Stores truncate to the cell width, narrower values would have to be extended first
+          Inst *value = inst->inputs[1];
+          stored.insert(location.offset);
+          exitValues[location.offset] = resolveType(value) == cellType ? value : nullptr;
+        }
+      }
+      if (!affine) break;
+    }
+    if (!affine) continue;
+
+    Builder b(graph);
+    std::vector<std::pair<Inst*, Inst*>> replacements;
+    auto &predecessors = loop.header->predecessors;
+    for (auto &loads : entryLoads) {
+      auto carried = exitValues.find(loads.first + induction.step);
+      if (carried == exitValues.end() || carried->second == nullptr) continue;
+
+      b.setBefore(loop.preheader->last);
+      Inst *address = induction.start;
+      if (loads.first != 0) address = b.pushGep(address, b.pushImm(loads.first, T_SIZE));
+      Inst *initial = b.pushLd(address);
+
+      b.setAfter(loop.header, nullptr);
+      Inst *phi = b.pushPhi();
+      phi->type = cellType;
+      for (Block *predecessor : predecessors) {
+        phi->addInput(predecessor == loop.latch ? carried->second : initial);
+      }
+      for (Inst *load : loads.second) {
+        replacements.emplace_back(load, phi);
+      }
+    }
+
+    // Carried values may themselves be loads that are being replaced, rewriting updates the phis as well
+    for (auto &replacement : replacements) {
+      replacement.first->rewriteWith(replacement.second);
+    }
+    return !replacements.empty();
+  }
+  return false;
+}
+
+void Opt::optimizeInductions(Graph &graph) {
+  for (Loop &loop : findLoops(graph)) {
+    forwardCarriedCells(graph, loop);
+  }
+}
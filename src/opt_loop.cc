@@ -1,7 +1,264 @@
+#include <algorithm>
+#include <map>
+
 #include "opt.h"
 
 using namespace IR;
+using namespace Opt;
+
+std::vector<Loop> Opt::findLoops(Graph &graph) {
+  if (!graph.builtDominators) graph.buildDominators();
+
+  std::vector<Loop> loops;
+  std::unordered_map<Block*, size_t> headers;
+
+  for (Block *block : graph.blocks) {
+    if (block->orphan) continue;
+    for (Block *header : block->successors) {
+      // A back edge goes to a block which dominates its source
+      if (header->id > block->id || !header->dominates(block)) continue;
+
+      Loop *loop;
+      if (headers.contains(header)) {
+        loop = &loops[headers[header]];
+        loop->latch = nullptr;
+      } else {
+        headers[header] = loops.size();
+        loop = &loops.emplace_back();
+        loop->header = header;
+        loop->latch = block;
+        loop->members.insert(header);
+      }
+
+      // Everything reaching the back edge without passing through the header is part of the loop
+      std::vector<Block*> queue;
+      if (loop->members.insert(block).second) queue.push_back(block);
+      while (!queue.empty()) {
+        Block *cur = queue.back();
+        queue.pop_back();
+        for (Block *predecessor : cur->predecessors) {
+          if (loop->members.insert(predecessor).second) queue.push_back(predecessor);
+        }
+      }
+    }
+  }
+
+  for (Loop &loop : loops) {
+    loop.blocks.assign(loop.members.begin(), loop.members.end());
+    std::sort(loop.blocks.begin(), loop.blocks.end(), [](Block *a, Block *b) { return a->id < b->id; });
+    assert(loop.blocks[0] == loop.header);
+
+    Block *entering = nullptr;
+    size_t enteringCount = 0;
+    for (Block *predecessor : loop.header->predecessors) {
+      if (loop.contains(predecessor)) continue;
+      entering = predecessor;
+      enteringCount++;
+    }
+    if (enteringCount == 1 && entering->successors.size() == 1) {
+      loop.preheader = entering;
+    }
+
+    Block *exit = nullptr;
+    size_t exitCount = 0;
+    for (Block *block : loop.blocks) {
+      for (Block *successor : block->successors) {
+        if (loop.contains(successor)) continue;
+        exit = successor;
+        exitCount++;
+      }
+    }
+    if (exitCount == 1 && exit->predecessors.size() == 1) {
+      loop.exit = exit;
+    }
+  }
+
+  // An inner loop always has fewer blocks than the loops around it
+  std::stable_sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+    return a.blocks.size() < b.blocks.size();
+  });
+  return loops;
+}
+
+// Summary of how a loop accesses memory
+struct LoopMemory {
+  // Whether the loop contains an instruction with unknown effects on memory
+  bool clobbers = false;
+  std::vector<Inst*> accesses;
+  std::vector<Location> stores;
+
+  explicit LoopMemory(const Loop &loop) {
+    for (Block *block : loop.blocks) {
+      for (Inst *inst = block->first; inst != nullptr; inst = inst->next) {
+        if (inst->kind == I_LD) {
+          accesses.push_back(inst);
+        } else if (inst->kind == I_STR) {
+          accesses.push_back(inst);
+          stores.push_back(locate(inst->inputs[0]));
+        } else if (instMayStore(inst->kind) || instMayLoad(inst->kind)) {
+          clobbers = true;
+        }
+      }
+    }
+  }
+
+  // Whether no store in the loop can change the cell at [location]
+  [[nodiscard]] bool isInvariant(const Location &location) const {
+    if (clobbers) return false;
+    return std::all_of(stores.begin(), stores.end(), [&](const Location &store) {
+      return store.base == location.base && store.offset != location.offset;
+    });
+  }
+};
+
+static bool isDefinedOutside(const Loop &loop, Inst *inst) {
+  return !loop.contains(inst->block);
+}
+
+// Moves pure instructions whose inputs are all defined outside the loop into the preheader
+static void hoistInvariants(const Loop &loop) {
+  LoopMemory memory(loop);
+  for (Block *block : loop.blocks) {
+    // Loads are only hoisted from blocks that run on every iteration
+    bool everyIteration = block == loop.header || block->dominates(loop.latch);
+    Inst *inst = block->first;
+    while (inst != nullptr) {
+      Inst *next = inst->next;
+      bool hoist = false;
+      switch (inst->kind) {
+        case I_IMM:
+        case I_ADD:
+        case I_SUB:
+        case I_MUL:
+        case I_DIV:
+        case I_MOD:
+        case I_LT:
+        case I_GEP:
+        case I_SELECT:
+          hoist = true;
+          break;
+        case I_LD:
+          hoist = everyIteration && memory.isInvariant(locate(inst->inputs[0]));
+          break;
+        default:
+          break;
+      }
+      if (hoist) {
+        for (Inst *input : inst->inputs) {
+          hoist = hoist && isDefinedOutside(loop, input);
+        }
+      }
+      if (hoist) {
+        loop.preheader->moveBefore(inst, loop.preheader->last);
+      }
+      inst = next;
+    }
+  }
+}
+
+// Replaces every access of cells at fixed offsets from a single invariant base with SSA values, loading the cells
+// in the preheader and storing the ones that changed at the exit
+static bool promoteCells(Graph &graph, const Loop &loop) {
+  TypeId cellType = typeForWidth(graph.config.cellWidth);
+  LoopMemory memory(loop);
+  if (memory.clobbers || memory.accesses.empty()) return false;
+
+  Inst *base = nullptr;
+  std::map<int64_t, bool> cells;
+  for (Inst *access : memory.accesses) {
+    auto location = locate(access->inputs[0]);
+    if (base == nullptr) base = location.base;
+    if (location.base != base || !isDefinedOutside(loop, base)) return false;
+    if (access->kind == I_STR) {
+      if (resolveType(access->inputs[1]) != cellType) return false;
+      cells[location.offset] = true;
+    } else {
+      cells.emplace(location.offset, false);
+    }
+  }
+
+  // Blocks other than the header can only be entered from inside the loop
+  for (Block *block : loop.blocks) {
+    if (block == loop.header) continue;
+    for (Block *predecessor : block->predecessors) {
+      if (!loop.contains(predecessor)) return false;
+    }
+  }
+
+  Builder b(graph);
+  b.setBefore(loop.preheader->last);
+  std::map<int64_t, Inst*> addresses;
+  std::map<int64_t, Inst*> initial;
+  for (auto &cell : cells) {
+    Inst *address = cell.first == 0 ? base : b.pushGep(base, b.pushImm(cell.first, T_SIZE));
+    addresses[cell.first] = address;
+    initial[cell.first] = b.pushLd(address);
+  }
+
+  // Current value of each cell at the end of each block
+  std::unordered_map<Block*, std::map<int64_t, Inst*>> exitValues;
+  std::vector<std::pair<Inst*, int64_t>> pendingPhis;
+  exitValues[loop.preheader] = initial;
+
+  for (Block *block : loop.blocks) {
+    std::map<int64_t, Inst*> values;
+    if (block->predecessors.size() == 1 && block->predecessors[0]->id < block->id) {
+      values = exitValues[block->predecessors[0]];
+    } else {
+      // Inputs are filled in once every predecessor has been visited
+      b.setAfter(block, nullptr);
+      for (auto &cell : cells) {
+        Inst *phi = b.pushPhi();
+        phi->type = cellType;
+        values[cell.first] = phi;
+        pendingPhis.emplace_back(phi, cell.first);
+      }
+    }
+
+    Inst *inst = block->first;
+    while (inst != nullptr) {
+      Inst *next = inst->next;
+      if (inst->kind == I_LD) {
+        inst->rewriteWith(values[locate(inst->inputs[0]).offset]);
+      } else if (inst->kind == I_STR) {
+        values[locate(inst->inputs[0]).offset] = inst->inputs[1];
+        inst->destroy();
+      }
+      inst = next;
+    }
+    exitValues[block] = std::move(values);
+  }
+
+  std::vector<Inst*> phis;
+  for (auto &pending : pendingPhis) {
+    Inst *phi = pending.first;
+    for (Block *predecessor : phi->block->predecessors) {
+      phi->addInput(exitValues[predecessor][pending.second]);
+    }
+    phis.push_back(phi);
+  }
+
+  // The exit is only branched to from the loop, write back the cells that may have changed there
+  Block *exiting = loop.exit->predecessors[0];
+  b.setAfter(loop.exit, nullptr);
+  for (auto &cell : cells) {
+    if (!cell.second) continue;
+    b.pushStr(addresses[cell.first], exitValues[exiting][cell.first]);
+  }
+
+  removeTrivialPhis(std::move(phis));
+  return true;
+}
 
 void Opt::optimizeLoops(Graph &graph) {
-  
-}
\ No newline at end of file
+  // Folding may have left phis that only see one value, which would hide invariant pointers
+  removeTrivialPhis(graph);
+
+  for (Loop &loop : findLoops(graph)) {
+    if (loop.preheader == nullptr || loop.latch == nullptr) continue;
+    hoistInvariants(loop);
+    if (loop.exit != nullptr) {
+      promoteCells(graph, loop);
+    }
+  }
+}
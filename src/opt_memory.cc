@@ -0,0 +1,216 @@
+#include "opt.h"
+
+using namespace IR;
+
+Opt::Location Opt::locate(Inst *address) {
+  Location location;
+  while (address->kind == I_GEP && address->inputs[1]->kind == I_IMM) {
+    location.offset += address->inputs[1]->immValue;
+    address = address->inputs[0];
+  }
+  location.base = address;
+  return location;
+}
+
+// Known cell contents, grouped by base pointer since cells of different bases may alias
+struct MemoryState {
+  std::unordered_map<Inst*, std::unordered_map<int64_t, Inst*>> cells;
+
+  Inst *lookup(const Opt::Location &location) {
+    auto base = cells.find(location.base);
+    if (base == cells.end()) return nullptr;
+    auto cell = base->second.find(location.offset);
+    return cell == base->second.end() ? nullptr : cell->second;
+  }
+
+  // Records a load or store of [value], a store also invalidates every cell that might alias
+  void set(const Opt::Location &location, Inst *value, bool store) {
+    if (store) {
+      for (auto it = cells.begin(); it != cells.end();) {
+        it = it->first == location.base ? std::next(it) : cells.erase(it);
+      }
+    }
+    cells[location.base][location.offset] = value;
+  }
+};
+
+struct MemoryBlockState {
+  MemoryState exit;
+  // Successors which have yet to take a copy of the exit state
+  size_t pendingSuccessors = 0;
+};
+
+static bool sameValue(Inst *a, Inst *b) {
+  if (a == b) return true;
+  return a->kind == I_IMM && b->kind == I_IMM && a->immValue == b->immValue && a->type == b->type;
+}
+
+struct MemoryEngine {
+  Graph &graph;
+  Builder b;
+  TypeId cellType;
+
+  explicit MemoryEngine(Graph &graph) :
+    graph(graph),
+    b(graph),
+    cellType(typeForWidth(graph.config.cellWidth)) {}
+
+  // The only predecessor of [block] if it is a forward edge, which the entry state can be inherited from
+  static Block *inheritedFrom(Block *block) {
+    if (block->predecessors.size() != 1) return nullptr;
+    Block *predecessor = block->predecessors[0];
+    return predecessor->id < block->id ? predecessor : nullptr;
+  }
+
+  MemoryState entryState(Block *block) {
+    Block *predecessor = inheritedFrom(block);
+    if (predecessor == nullptr) return {};
+    auto predecessorState = (MemoryBlockState*)predecessor->passData;
+    assert(predecessorState != nullptr);
+
+    MemoryState state;
+    if (--predecessorState->pendingSuccessors == 0) {
+      state = std::move(predecessorState->exit);
+    } else {
+      state = predecessorState->exit;
+    }
+
+    // Leaving a loop through the false edge of its condition means every cell holding the condition is zero
+    Inst *branch = predecessor->last;
+    if (branch->kind == I_IF && predecessor->successors[1] == block && predecessor->successors[0] != block) {
+      Inst *cond = branch->inputs[0];
+      Inst *zero = nullptr;
+      for (auto &base : state.cells) {
+        for (auto &cell : base.second) {
+          if (cell.second != cond) continue;
+          if (zero == nullptr) {
+            b.setAfter(block, nullptr);
+            zero = b.pushImm(0, cellType);
+          }
+          cell.second = zero;
+        }
+      }
+    }
+    return state;
+  }
+
+  // Forwards known cell values to loads and drops stores of values the cell already holds
+  void forwardBlock(Block *block, MemoryState &state) {
+    Inst *inst = block->first;
+    while (inst != nullptr) {
+      Inst *next = inst->next;
+      switch (inst->kind) {
+        case I_LD: {
+          auto location = Opt::locate(inst->inputs[0]);
+          Inst *value = state.lookup(location);
+          if (value != nullptr) {
+            inst->rewriteWith(value);
+          } else {
+            state.set(location, inst, false);
+          }
+          break;
+        } case I_STR: {
+          auto location = Opt::locate(inst->inputs[0]);
+          Inst *value = inst->inputs[1];
+          Inst *known = state.lookup(location);
+          if (known != nullptr && sameValue(known, value)) {
+            inst->destroy();
+          } else {
+            state.set(location, value, true);
+            // Stores truncate, a value of another type can not be forwarded as is
+            if (Opt::resolveType(value) != cellType) state.cells[location.base].erase(location.offset);
+          }
+          break;
+        } default:
+          if (instMayStore(inst->kind)) state.cells.clear();
+          break;
+      }
+      inst = next;
+    }
+  }
+
+  // Removes stores which are overwritten before anything can observe them, [overwritten] holds the locations
+  // stored to later on every path out of the block
+  void eliminateDeadStores(Block *block, std::unordered_map<Inst*, std::unordered_set<int64_t>> overwritten) {
+    Inst *inst = block->last;
+    while (inst != nullptr) {
+      Inst *prev = inst->prev;
+      if (inst->kind == I_STR) {
+        auto location = Opt::locate(inst->inputs[0]);
+        auto &offsets = overwritten[location.base];
+        if (offsets.contains(location.offset)) {
+          inst->destroy();
+        } else {
+          offsets.insert(location.offset);
+        }
+      } else if (inst->kind == I_LD) {
+        auto location = Opt::locate(inst->inputs[0]);
+        for (auto it = overwritten.begin(); it != overwritten.end();) {
+          if (it->first == location.base) {
+            it->second.erase(location.offset);
+            it++;
+          } else {
+            it = overwritten.erase(it);
+          }
+        }
+      } else if (instMayLoad(inst->kind)) {
+        overwritten.clear();
+      }
+      inst = prev;
+    }
+    block->passData = new std::unordered_map<Inst*, std::unordered_set<int64_t>>(std::move(overwritten));
+  }
+
+  void run() {
+    graph.clearPassData();
+
+    for (Block *block : graph.blocks) {
+      if (block->orphan) continue;
+      auto state = new MemoryBlockState();
+      for (Block *successor : block->successors) {
+        if (inheritedFrom(successor) == block) state->pendingSuccessors++;
+      }
+      block->passData = state;
+    }
+
+    // Block ids are ordered so that forward edges always point to a higher id
+    for (Block *block : graph.blocks) {
+      if (block->orphan) continue;
+      MemoryState state = entryState(block);
+      forwardBlock(block, state);
+      auto blockState = (MemoryBlockState*)block->passData;
+      if (blockState->pendingSuccessors != 0) {
+        blockState->exit = std::move(state);
+      }
+    }
+
+    for (Block *block : graph.blocks) {
+      delete (MemoryBlockState*)block->passData;
+      block->passData = nullptr;
+    }
+
+    // Stores are dead at the end of a block if its only successor overwrites them before reading
+    typedef std::unordered_map<Inst*, std::unordered_set<int64_t>> Overwritten;
+    for (auto it = graph.blocks.rbegin(); it != graph.blocks.rend(); it++) {
+      Block *block = *it;
+      if (block->orphan) continue;
+      Overwritten overwritten;
+      if (block->successors.size() == 1) {
+        Block *successor = block->successors[0];
+        if (successor->id > block->id && successor->predecessors.size() == 1 && successor->passData != nullptr) {
+          overwritten = *(Overwritten*)successor->passData;
+        }
+      }
+      eliminateDeadStores(block, std::move(overwritten));
+    }
+
+    for (Block *block : graph.blocks) {
+      delete (Overwritten*)block->passData;
+      block->passData = nullptr;
+    }
+  }
+};
+
+void Opt::optimizeMemory(Graph &graph) {
+  MemoryEngine(graph).run();
+}
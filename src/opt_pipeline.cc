@@ -0,0 +1,109 @@
+#include "opt.h"
+
+using namespace IR;
+
+Opt::Pipeline::Pipeline(const BFVM::Config &config) : config(config) {}
+
+void Opt::Pipeline::run(Graph &graph) {
+  runEarly(graph);
+  runLate(graph);
+}
+
+void Opt::Pipeline::runEarly(Graph &graph) {
+  runPass(graph, "Resolve registers", [](Graph &graph) {
+    resolveRegs(graph);
+  });
+
+  runPass(graph, "Fold", [](Graph &graph) {
+    fold(graph, standardFoldRules());
+  });
+}
+
+void Opt::Pipeline::runLate(Graph &graph) {
+  runPass(graph, "Propagate constants", [](Graph &graph) {
+    propagateConstants(graph);
+  });
+
+  runPass(graph, "Simplify control flow", [](Graph &graph) {
+    simplifyCFG(graph);
+  });
+
+  runPass(graph, "Counted loops", [](Graph &graph) {
+    evaluateCountedLoops(graph);
+  });
+
+  runPass(graph, "Convert if loops", [](Graph &graph) {
+    convertIfLoops(graph);
+  });
+
+  runPass(graph, "Loops", [](Graph &graph) {
+    optimizeLoops(graph);
+  });
+
+  runPass(graph, "Forward memory", [](Graph &graph) {
+    optimizeMemory(graph);
+  });
+
+  runPass(graph, "Induction variables", [](Graph &graph) {
+    optimizeInductions(graph);
+  });
+
+  runPass(graph, "Common expressions", [](Graph &graph) {
+    optimizeCommonExpr(graph);
+  });
+
+  runPass(graph, "Rotate loops", [](Graph &graph) {
+    rotateLoops(graph);
+  });
+
+  // Forwarded stores leave behind arithmetic on constants, which would hide copies
+  runPass(graph, "Fold", [](Graph &graph) {
+    fold(graph, standardFoldRules());
+  });
+
+  runPass(graph, "Bulk memory", [](Graph &graph) {
+    lowerBulkMemory(graph);
+  });
+}
+
+// Runs [pass] over the program and each of its functions
+static void runOnEach(Graph &graph, const std::function<void(Graph&)> &pass) {
+  pass(graph);
+  for (auto &function : graph.functions) {
+    pass(*function);
+  }
+}
+
+// Instructions and blocks allocated so far by the program and its functions
+static std::pair<int, int> countAllocs(Graph &graph) {
+  std::pair<int, int> allocs;
+  runOnEach(graph, [&](Graph &each) {
+    allocs.first += each.nextInstId;
+    allocs.second += each.nextBlockId;
+  });
+  return allocs;
+}
+
+void Opt::Pipeline::runPass(Graph &graph, const std::string &name, const std::function<void(Graph&)> &pass) {
+  DIAG(eventStart, name)
+
+  if (report == nullptr) {
+    runOnEach(graph, pass);
+  } else {
+    Report::Pass &record = report->passes.emplace_back();
+    record.name = name;
+    record.before = Report::measure(graph);
+    auto startAllocs = countAllocs(graph);
+    int64_t startTime = Util::Time::getTime();
+
+    runOnEach(graph, pass);
+
+    record.time = Util::Time::getTime() - startTime;
+    auto allocs = countAllocs(graph);
+    record.instAllocs = allocs.first - startAllocs.first;
+    record.blockAllocs = allocs.second - startAllocs.second;
+    record.after = Report::measure(graph);
+  }
+
+  DIAG(eventFinish, name)
+}
@@ -105,7 +105,6 @@ void Opt::resolveRegs(Graph &graph) {
     assert(cur->kind == I_REG);
     RegKind reg = cur->immReg;
     Block *block = cur->block;
-    auto state = (BlockState*)block->passData;
     std::vector<Block*> &predecessors = block->predecessors;
     validateBlocks(graph);
     if (predecessors.empty()) {
@@ -116,8 +115,9 @@ void Opt::resolveRegs(Graph &graph) {
       // Should not be a frontier
       assert(predecessors.size() >= 2);
 
-      // Build a new phi node with state inputs from each predecessor
-      builder.setAfter(cur);
+      // Build a new phi node with state inputs from each predecessor, at the start of the block as passes only look for
+      // phis there. The register is not necessarily read first, a getchar can start the join of an idiom
+      builder.setAfter(block, nullptr);
       validateBlocks(graph);
       Inst *phi = builder.pushPhi();
       validateBlocks(graph);
@@ -153,8 +153,7 @@ void Opt::resolveRegs(Graph &graph) {
       }
       validateBlocks(graph);
 
-      // Rewrite unresolved register with new phi
-      state->states[cur->immReg] = phi;
+      // Rewrite unresolved register with new phi, the state of its block only if the block does not set it again
       cur->rewriteWith(phi);
       // TODO: make this efficient, it has quadratic complexity
       for (Block *curBlock : graph.blocks) {
@@ -175,4 +174,44 @@ void Opt::resolveRegs(Graph &graph) {
     delete (BlockState*)block->passData;
     block->passData = nullptr;
   }
+
+  // Remove phis of registers that are never changed on some path, like the pointer in a loop that does not move it
+  removeTrivialPhis(graph);
+}
+
+void Opt::removeTrivialPhis(Graph &graph) {
+  std::vector<Inst*> phis;
+  for (Block *block : graph.blocks) {
+    for (Inst *inst = block->first; inst != nullptr; inst = inst->next) {
+      if (inst->kind == I_PHI) phis.push_back(inst);
+    }
+  }
+  removeTrivialPhis(std::move(phis));
+}
+
+void Opt::removeTrivialPhis(std::vector<Inst*> phis) {
+  std::unordered_set<Inst*> removed;
+  while (!phis.empty()) {
+    Inst *phi = phis.back();
+    phis.pop_back();
+    if (removed.contains(phi)) continue;
+    Inst *value = trivialPhiInput(phi);
+    if (value == nullptr) continue;
+    // Phis using this one may become trivial too
+    for (Inst *output : phi->outputs) {
+      if (output->kind == I_PHI && output != phi) phis.push_back(output);
+    }
+    removed.insert(phi);
+    phi->rewriteWith(value);
+  }
+}
+
+Inst *Opt::trivialPhiInput(Inst *phi) {
+  Inst *value = nullptr;
+  for (Inst *input : phi->inputs) {
+    if (input == phi || input == value) continue;
+    if (value != nullptr) return nullptr;
+    value = input;
+  }
+  return value;
 }
\ No newline at end of file
@@ -19,24 +19,37 @@ static TypeId rawGetType(ResolutionState &state, Inst *inst) {
     case I_GOTO:
     case I_RET:
     case I_PUTCHAR:
+    case I_WRITE:
     case I_STR:
+    case I_FILL:
+    case I_COPY:
+    case I_VSTR:
+    case I_VADD:
       return T_NONE;
     case I_IMM:
       abort(); // Given type by builder
     case I_ADD:
-    case I_SUB: {
-      TypeId ltype = getType(state, inst->inputs[0]);
+    case I_SUB:
+    case I_MUL:
+    case I_DIV:
+    case I_MOD:
+    case I_LT:
+    case I_SELECT: {
+      // The condition of a select does not take part in its type
+      size_t first = inst->kind == I_SELECT ? 1 : 0;
+      TypeId ltype = getType(state, inst->inputs[first]);
       if (ltype == T_INVALID) {
         return T_INVALID;
       }
       assert(ltype != T_NONE);
-      TypeId rtype = getType(state, inst->inputs[1]);
+      TypeId rtype = getType(state, inst->inputs[first + 1]);
       if (rtype == T_INVALID) {
         return T_INVALID;
       }
       assert(rtype != T_NONE);
       return maxType(ltype, rtype);
     } case I_GEP:
+    case I_CALL:
       return T_PTR;
     case I_LD:
     case I_GETCHAR:
@@ -0,0 +1,433 @@
+#include <set>
+
+#include "opt.h"
+
+using namespace IR;
+
+enum LatticeKind : uint8_t {
+  // Not reached yet, optimistically assumed to be any value
+  L_UNKNOWN,
+  L_CONST,
+  // May hold more than one value
+  L_OVER,
+};
+
+struct Lattice {
+  LatticeKind kind = L_UNKNOWN;
+  uint64_t value = 0;
+
+  static Lattice constant(uint64_t value) { return {L_CONST, value}; }
+  static Lattice over() { return {L_OVER, 0}; }
+
+  [[nodiscard]] bool isConst() const { return kind == L_CONST; }
+
+  bool operator==(const Lattice &other) const = default;
+};
+
+static Lattice meet(Lattice a, Lattice b) {
+  if (a.kind == L_UNKNOWN) return b;
+  if (b.kind == L_UNKNOWN) return a;
+  return a == b ? a : Lattice::over();
+}
+
+static uint64_t typeMask(TypeId type) {
+  switch (type) {
+    case T_I8: return 0xFFu;
+    case T_I16: return 0xFFFFu;
+    case T_I32: return 0xFFFFFFFFu;
+    default: return ~(uint64_t)0;
+  }
+}
+
+// Cells at constant offsets from one base pointer
+struct TapeBase {
+  // Whether cells without an entry are zero, otherwise nothing is known about them
+  bool zeroed = false;
+  std::unordered_map<int64_t, Lattice> cells;
+
+  [[nodiscard]] Lattice fallback() const {
+    return zeroed ? Lattice::constant(0) : Lattice::over();
+  }
+
+  [[nodiscard]] Lattice get(int64_t offset) const {
+    auto cell = cells.find(offset);
+    return cell == cells.end() ? fallback() : cell->second;
+  }
+
+  bool operator==(const TapeBase &other) const = default;
+};
+
+// What is known about the tape at some point of the program, cells of different bases may alias
+struct TapeState {
+  // Whether cells of bases without an entry are zero, the tape starts zeroed
+  bool zeroed = true;
+  std::unordered_map<Inst*, TapeBase> bases;
+
+  [[nodiscard]] Lattice load(const Opt::Location &location) const {
+    auto base = bases.find(location.base);
+    if (base == bases.end()) return zeroed ? Lattice::constant(0) : Lattice::over();
+    return base->second.get(location.offset);
+  }
+
+  void store(const Opt::Location &location, Lattice value) {
+    bool keepsZero = value.kind == L_UNKNOWN || value == Lattice::constant(0);
+    for (auto &base : bases) {
+      if (base.first == location.base) continue;
+      // Either the cell is the one stored to, or it keeps its value
+      for (auto &cell : base.second.cells) {
+        cell.second = meet(cell.second, value);
+      }
+      base.second.zeroed = base.second.zeroed && keepsZero;
+    }
+    auto base = bases.find(location.base);
+    if (base == bases.end()) {
+      base = bases.emplace(location.base, TapeBase{zeroed, {}}).first;
+    }
+    base->second.cells[location.offset] = value;
+    zeroed = zeroed && keepsZero;
+  }
+
+  void clobber() {
+    zeroed = false;
+    bases.clear();
+  }
+
+  void meetWith(const TapeState &other) {
+    for (auto &base : other.bases) {
+      if (!bases.contains(base.first)) bases.emplace(base.first, TapeBase{zeroed, {}});
+    }
+    for (auto &base : bases) {
+      auto theirs = other.bases.find(base.first);
+      TapeBase missing{other.zeroed, {}};
+      const TapeBase &otherBase = theirs == other.bases.end() ? missing : theirs->second;
+      TapeBase &ourBase = base.second;
+      for (auto &cell : ourBase.cells) {
+        cell.second = meet(cell.second, otherBase.get(cell.first));
+      }
+      for (auto &cell : otherBase.cells) {
+        if (!ourBase.cells.contains(cell.first)) {
+          ourBase.cells[cell.first] = meet(ourBase.fallback(), cell.second);
+        }
+      }
+      ourBase.zeroed = ourBase.zeroed && otherBase.zeroed;
+    }
+    zeroed = zeroed && other.zeroed;
+  }
+
+  // Drops entries which say no more than the fallback, so equal states compare equal
+  void canonicalize() {
+    for (auto &base : bases) {
+      Lattice fallback = base.second.fallback();
+      std::erase_if(base.second.cells, [&](auto &cell) { return cell.second == fallback; });
+    }
+    std::erase_if(bases, [&](auto &base) {
+      return base.second.cells.empty() && base.second.zeroed == zeroed;
+    });
+  }
+
+  bool operator==(const TapeState &other) const = default;
+};
+
+struct SCCPBlockState {
+  bool executable = false;
+  bool visited = false;
+  // Whether the edge to each successor has been found to be taken
+  std::vector<bool> taken;
+  TapeState exit;
+};
+
+static SCCPBlockState *stateOf(Block *block) {
+  return (SCCPBlockState*)block->passData;
+}
+
+static bool edgeTaken(Block *from, Block *to) {
+  auto state = stateOf(from);
+  for (size_t i = 0; i < from->successors.size(); i++) {
+    if (from->successors[i] == to && state->taken[i]) return true;
+  }
+  return false;
+}
+
+struct BlockOrder {
+  bool operator()(Block *a, Block *b) const { return a->id < b->id; }
+};
+
+// Sparse conditional constant propagation, tracking cells at constant offsets alongside SSA values
+struct SCCPEngine {
+  Graph &graph;
+  Builder b;
+  TypeId cellType;
+
+  std::unordered_map<Inst*, Lattice> values;
+  std::set<Block*, BlockOrder> worklist;
+
+  explicit SCCPEngine(Graph &graph) :
+    graph(graph),
+    b(graph),
+    cellType(typeForWidth(graph.config.cellWidth)) {}
+
+  Lattice valueOf(Inst *inst) {
+    if (inst->kind == I_IMM) return Lattice::constant((uint64_t)inst->immValue & typeMask(Opt::resolveType(inst)));
+    auto value = values.find(inst);
+    return value == values.end() ? Lattice() : value->second;
+  }
+
+  // Value written to a cell when storing [inst], stores truncate to the cell width
+  Lattice storedValue(Inst *inst) {
+    Lattice value = valueOf(inst);
+    if (!value.isConst()) return value;
+    if (typeMask(Opt::resolveType(inst)) < typeMask(cellType) && value.value != 0) return Lattice::over();
+    return Lattice::constant(value.value & typeMask(cellType));
+  }
+
+  TapeState entryState(Block *block) {
+    TapeState state;
+    if (block == graph.blocks[0]) {
+      // Functions start from whatever their caller left on the tape
+      if (graph.owner != nullptr) state.clobber();
+      return state;
+    }
+    bool first = true;
+    for (Block *predecessor : block->predecessors) {
+      if (!edgeTaken(predecessor, block)) continue;
+      if (first) {
+        state = stateOf(predecessor)->exit;
+        first = false;
+      } else {
+        state.meetWith(stateOf(predecessor)->exit);
+      }
+    }
+    // Pointers defined inside a loop point somewhere else on every iteration, what was known about the old one is void
+    std::erase_if(state.bases, [&](auto &base) {
+      Block *defined = base.first->block;
+      return defined == block || !defined->dominates(block);
+    });
+    return state;
+  }
+
+  Lattice evaluate(Inst *inst, TapeState &state) {
+    switch (inst->kind) {
+      case I_ADD:
+      case I_SUB:
+      case I_MUL:
+      case I_DIV:
+      case I_MOD:
+      case I_LT: {
+        TypeId type = Opt::resolveType(inst);
+        Inst *left = inst->inputs[0];
+        Inst *right = inst->inputs[1];
+        Lattice x = valueOf(left);
+        Lattice y = valueOf(right);
+        if (x.kind == L_OVER || y.kind == L_OVER) return Lattice::over();
+        if (x.kind == L_UNKNOWN || y.kind == L_UNKNOWN) return {};
+        // Mixed widths would need sign extension rules, leave them to the backend
+        if (Opt::resolveType(left) != type || Opt::resolveType(right) != type) return Lattice::over();
+        uint64_t result;
+        switch (inst->kind) {
+          case I_ADD: result = x.value + y.value; break;
+          case I_SUB: result = x.value - y.value; break;
+          case I_MUL: result = x.value * y.value; break;
+          case I_DIV: result = y.value == 0 ? x.value : x.value / y.value; break;
+          case I_MOD: result = y.value == 0 ? 0 : x.value % y.value; break;
+          default: result = x.value < y.value; break;
+        }
+        return Lattice::constant(result & typeMask(type));
+      } case I_SELECT: {
+        TypeId type = Opt::resolveType(inst);
+        if (Opt::resolveType(inst->inputs[1]) != type || Opt::resolveType(inst->inputs[2]) != type) {
+          return Lattice::over();
+        }
+        Lattice cond = valueOf(inst->inputs[0]);
+        if (cond.kind == L_UNKNOWN) return {};
+        if (cond.isConst()) return valueOf(inst->inputs[(cond.value & typeMask(cellType)) != 0 ? 1 : 2]);
+        return meet(valueOf(inst->inputs[1]), valueOf(inst->inputs[2]));
+      } case I_LD:
+        return state.load(Opt::locate(inst->inputs[0]));
+      case I_PHI: {
+        Lattice result;
+        for (size_t i = 0; i < inst->inputs.size(); i++) {
+          if (edgeTaken(inst->block->predecessors[i], inst->block)) {
+            result = meet(result, valueOf(inst->inputs[i]));
+          }
+        }
+        return result;
+      } default:
+        return Lattice::over();
+    }
+  }
+
+  void update(Inst *inst, Lattice value) {
+    Lattice &old = values[inst];
+    // Values only ever move down the lattice, which bounds the number of visits
+    value = meet(old, value);
+    if (value == old) return;
+    old = value;
+    for (Inst *output : inst->outputs) {
+      Block *block = output->block;
+      if ((block != inst->block || output->kind == I_PHI) && stateOf(block)->visited) worklist.insert(block);
+    }
+  }
+
+  void take(Block *block, size_t index) {
+    auto state = stateOf(block);
+    if (state->taken[index]) return;
+    state->taken[index] = true;
+    Block *successor = block->successors[index];
+    stateOf(successor)->executable = true;
+    worklist.insert(successor);
+  }
+
+  void visit(Block *block) {
+    TapeState state = entryState(block);
+    for (Inst *inst = block->first; inst != nullptr; inst = inst->next) {
+      switch (inst->kind) {
+        case I_IMM:
+          break;
+        case I_STR:
+          state.store(Opt::locate(inst->inputs[0]), storedValue(inst->inputs[1]));
+          break;
+        case I_IF: {
+          Lattice cond = valueOf(inst->inputs[0]);
+          if (cond.kind == L_OVER) {
+            take(block, 0);
+            take(block, 1);
+          } else if (cond.isConst()) {
+            take(block, (cond.value & typeMask(cellType)) != 0 ? 0 : 1);
+          }
+          break;
+        } case I_GOTO:
+          take(block, 0);
+          break;
+        default:
+          if (instMayStore(inst->kind)) state.clobber();
+          if (instIsPure(inst->kind) || inst->kind == I_GETCHAR) update(inst, evaluate(inst, state));
+          break;
+      }
+    }
+
+    state.canonicalize();
+    auto blockState = stateOf(block);
+    if (blockState->visited && blockState->exit == state) return;
+    blockState->visited = true;
+    blockState->exit = std::move(state);
+    for (size_t i = 0; i < block->successors.size(); i++) {
+      if (blockState->taken[i]) worklist.insert(block->successors[i]);
+    }
+  }
+
+  Inst *materialize(Inst *inst, uint64_t value) {
+    if (inst->kind == I_PHI) {
+      Inst *lastPhi = inst;
+      while (lastPhi->next != nullptr && lastPhi->next->kind == I_PHI) lastPhi = lastPhi->next;
+      b.setAfter(lastPhi);
+    } else {
+      b.setBefore(inst);
+    }
+    TypeId type = Opt::resolveType(inst);
+    return b.pushImm(Opt::wrapImm((int64_t)value, type), type);
+  }
+
+  // Replaces values found to be constant and drops stores of the value a cell is known to hold
+  void rewriteBlock(Block *block) {
+    TapeState state = entryState(block);
+    Inst *inst = block->first;
+    while (inst != nullptr) {
+      Inst *next = inst->next;
+      if (inst->kind == I_STR) {
+        auto location = Opt::locate(inst->inputs[0]);
+        Lattice value = storedValue(inst->inputs[1]);
+        if (value.isConst() && state.load(location) == value) {
+          inst->destroy();
+        } else {
+          state.store(location, value);
+        }
+      } else if (inst->kind != I_IMM && instIsPure(inst->kind)) {
+        Lattice value = valueOf(inst);
+        if (value.isConst()) inst->rewriteWith(materialize(inst, value.value));
+      } else if (instMayStore(inst->kind)) {
+        state.clobber();
+      }
+      inst = next;
+    }
+  }
+
+  // Phis of reachable blocks losing a predecessor may be left with a single value
+  static void collectPhis(Block *block, std::vector<Inst*> &phis) {
+    if (!stateOf(block)->executable) return;
+    for (Inst *inst = block->first; inst != nullptr && inst->kind == I_PHI; inst = inst->next) {
+      phis.push_back(inst);
+    }
+  }
+
+  void run() {
+    if (!graph.builtDominators) graph.buildDominators();
+    graph.clearPassData();
+
+    for (Block *block : graph.blocks) {
+      if (block->orphan) continue;
+      auto state = new SCCPBlockState();
+      state->taken.resize(block->successors.size());
+      block->passData = state;
+    }
+
+    Block *entry = graph.blocks[0];
+    stateOf(entry)->executable = true;
+    worklist.insert(entry);
+    while (!worklist.empty()) {
+      Block *block = *worklist.begin();
+      worklist.erase(worklist.begin());
+      visit(block);
+    }
+
+    for (Block *block : graph.blocks) {
+      if (block->orphan || !stateOf(block)->executable) continue;
+      rewriteBlock(block);
+    }
+
+    // Branches on a constant lose their untaken edge, then blocks which were never reached are removed
+    std::vector<Inst*> phis;
+    bool changed = false;
+    for (Block *block : graph.blocks) {
+      if (block->orphan || !stateOf(block)->executable) continue;
+      auto state = stateOf(block);
+      if (block->last->kind == I_IF && state->taken[0] != state->taken[1]) {
+        Block *untaken = block->successors[state->taken[0] ? 1 : 0];
+        collectPhis(untaken, phis);
+        block->jumpTo(block->successors[state->taken[0] ? 0 : 1]);
+        changed = true;
+      }
+    }
+    for (Block *block : graph.blocks) {
+      if (block->orphan || stateOf(block)->executable) continue;
+      while (!block->successors.empty()) {
+        Block *successor = block->successors.back();
+        collectPhis(successor, phis);
+        block->removeSuccessor(successor);
+      }
+    }
+    for (Block *block : graph.blocks) {
+      if (block->orphan || stateOf(block)->executable) continue;
+      assert(block->predecessors.empty() || !stateOf(block->predecessors[0])->executable);
+      delete stateOf(block);
+      block->passData = nullptr;
+      block->destroy();
+      changed = true;
+    }
+
+    for (Block *block : graph.blocks) {
+      delete stateOf(block);
+      block->passData = nullptr;
+    }
+    graph.clearPassData();
+
+    if (changed) {
+      graph.removeOrphans();
+      graph.buildDominators();
+      Opt::removeTrivialPhis(std::move(phis));
+    }
+  }
+};
+
+void Opt::propagateConstants(Graph &graph) {
+  SCCPEngine(graph).run();
+}
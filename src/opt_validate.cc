@@ -89,6 +89,10 @@ void Opt::validate(Graph &graph) {
         case I_GETCHAR:
           assert(cur->inputs.empty());
           break;
+        case I_WRITE:
+          assert(cur->inputs.empty());
+          assert(cur->immValue >= 0 && (size_t)cur->immValue < graph.constants.size());
+          break;
         case I_GEP:
           assert(resolveType(cur->inputs[0]) == T_PTR);
           assert(resolveType(cur->inputs[1]) == T_SIZE);
@@ -96,14 +100,44 @@ void Opt::validate(Graph &graph) {
           break;
         case I_SUB:
         case I_ADD:
+        case I_MUL:
+        case I_DIV:
+        case I_MOD:
+        case I_LT:
         case I_STR:
           assert(cur->inputs.size() == 2);
           break;
+        case I_SELECT:
+          assert(cur->inputs.size() == 3);
+          break;
+        case I_FILL:
+          assert(cur->inputs.size() == 2);
+          assert(resolveType(cur->inputs[0]) == T_PTR);
+          assert(cur->immValue > 0);
+          break;
+        case I_VSTR:
+        case I_VADD:
+          assert(cur->inputs.size() == 1);
+          assert(resolveType(cur->inputs[0]) == T_PTR);
+          assert(cur->immValue >= 0 && (size_t)cur->immValue < graph.constants.size());
+          assert(!graph.constants[cur->immValue].empty());
+          break;
+        case I_COPY:
+          assert(cur->inputs.size() == 2);
+          assert(resolveType(cur->inputs[0]) == T_PTR);
+          assert(resolveType(cur->inputs[1]) == T_PTR);
+          assert(cur->immValue > 0);
+          break;
         case I_SETREG:
         case I_LD:
         case I_PUTCHAR:
           assert(cur->inputs.size() == 1);
           break;
+        case I_CALL:
+          assert(cur->inputs.size() == 1);
+          assert(resolveType(cur->inputs[0]) == T_PTR);
+          assert(cur->immValue >= 0 && (size_t)cur->immValue < graph.root().functions.size());
+          break;
         case I_PHI:
           assert(cur->inputs.size() == block->predecessors.size());
           break;
@@ -160,5 +194,10 @@ void Opt::validate(Graph &graph) {
       cur = cur->next;
     }
   }
+
+  for (auto &function : graph.functions) {
+    assert(function->owner == &graph);
+    validate(*function);
+  }
 #endif
 }
\ No newline at end of file
@@ -0,0 +1,96 @@
+#include <sstream>
+
+#include "report.h"
+
+using namespace IR;
+
+Report::GraphStats Report::measure(Graph &graph) {
+  GraphStats stats;
+  for (Block *block : graph.blocks) {
+    if (block->orphan) continue;
+    stats.blocks++;
+    Inst *inst = block->first;
+    while (inst != nullptr) {
+      stats.insts++;
+      switch (inst->kind) {
+        case I_PHI: stats.phis++; break;
+        case I_LD: stats.loads++; break;
+        case I_STR: stats.stores++; break;
+        default: break;
+      }
+      inst = inst->next;
+    }
+  }
+  for (auto &function : graph.functions) {
+    GraphStats inner = measure(*function);
+    stats.blocks += inner.blocks;
+    stats.insts += inner.insts;
+    stats.phis += inner.phis;
+    stats.loads += inner.loads;
+    stats.stores += inner.stores;
+  }
+  return stats;
+}
+
+std::string Report::escapeJson(const std::string &str) {
+  std::string out = "\"";
+  for (char c : str) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if ((unsigned char)c < 0x20) {
+          static const char *hex = "0123456789abcdef";
+          out += "\\u00";
+          out += hex[(c >> 4) & 0xF];
+          out += hex[c & 0xF];
+        } else {
+          out += c;
+        }
+    }
+  }
+  out += '"';
+  return out;
+}
+
+static void printStats(std::ostream &out, const Report::GraphStats &stats) {
+  out
+    << "{\"blocks\": " << stats.blocks
+    << ", \"insts\": " << stats.insts
+    << ", \"phis\": " << stats.phis
+    << ", \"loads\": " << stats.loads
+    << ", \"stores\": " << stats.stores
+    << "}";
+}
+
+std::string Report::Compile::toJson() const {
+  std::stringstream out;
+  out << "{\n  \"passes\": [";
+  bool first = true;
+  for (const Pass &pass : passes) {
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "    {\"name\": " << escapeJson(pass.name)
+      << ", \"time\": " << pass.time
+      << ", \"instAllocs\": " << pass.instAllocs
+      << ", \"blockAllocs\": " << pass.blockAllocs
+      << ",\n     \"before\": ";
+    printStats(out, pass.before);
+    out << ",\n     \"after\": ";
+    printStats(out, pass.after);
+    out << "}";
+  }
+  out << "\n  ],\n  \"llvm\": {";
+  first = true;
+  for (auto &[name, value] : llvmTimers) {
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "    " << escapeJson(name) << ": " << value;
+  }
+  if (!llvmTimers.empty()) out << "\n  ";
+  out << "}\n}\n";
+  return out.str();
+}
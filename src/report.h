@@ -0,0 +1,42 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+
+namespace Report {
+  // A snapshot of the size of a graph, including its functions
+  struct GraphStats {
+    size_t blocks = 0;
+    size_t insts = 0;
+    size_t phis = 0;
+    size_t loads = 0;
+    size_t stores = 0;
+  };
+
+  GraphStats measure(IR::Graph &graph);
+
+  // The effect of a single IR pass on a graph
+  struct Pass {
+    std::string name;
+    int64_t time = 0;
+    GraphStats before;
+    GraphStats after;
+    // Instructions and blocks allocated by the pass, including ones it destroyed again
+    size_t instAllocs = 0;
+    size_t blockAllocs = 0;
+  };
+
+  struct Compile {
+    std::vector<Pass> passes;
+
+    // LLVM pass timers by name, summed over every module of the program, empty if they were not collected
+    std::map<std::string, double> llvmTimers;
+
+    [[nodiscard]] std::string toJson() const;
+  };
+
+  std::string escapeJson(const std::string &str);
+}